@@ -5,9 +5,22 @@
 #include <string>
 #include <thread>
 #include <chrono>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+
+#include <netdb.h>       // getaddrinfo
+#include <sys/socket.h>  // socket, connect
+#include <unistd.h>      // close
+
 #include <grpcpp/grpcpp.h>
 #include "stdlib.h"
-#include "thread_pool.hpp"
+#include "profile/grpc/thread_pool.hpp"
+#include "crc32c.hpp"
+#include "profile/histogram.h"
 
 #ifdef BAZEL_BUILD
 #include "examples/protos/data.grpc.pb.h"
@@ -15,6 +28,19 @@
 #include "data.grpc.pb.h"
 #endif
 
+ABSL_FLAG(std::string, target, "localhost:50051", "Server address");
+ABSL_FLAG(uint32_t, rounds, 300, "rounds of uploads");
+ABSL_FLAG(uint32_t, tasks, 20, "uploads per round, spread over 5 threads");
+ABSL_FLAG(bool, work_stealing, true, "spread uploads over the 5 threads by work stealing instead of pinning upload i to thread i%5");
+ABSL_FLAG(uint32_t, size_mb, 100, "size of one upload in MB");
+ABSL_FLAG(uint32_t, retries, 3, "attempts after the first for a failed StreamingMethod call");
+ABSL_FLAG(uint32_t, retry_backoff_ms, 100, "pause before the first retry, doubled for every further one");
+ABSL_FLAG(bool, resumable, true, "send uploads as resumable transfers: a retry continues from the committed offset");
+ABSL_FLAG(bool, wait_for_ready, false, "queue calls while the channel reconnects instead of failing them");
+ABSL_FLAG(uint32_t, initial_backoff_ms, 0, "GRPC_ARG_INITIAL_RECONNECT_BACKOFF_MS (0: gRPC default)");
+ABSL_FLAG(uint32_t, min_backoff_ms, 0, "GRPC_ARG_MIN_RECONNECT_BACKOFF_MS (0: gRPC default)");
+ABSL_FLAG(uint32_t, max_backoff_ms, 0, "GRPC_ARG_MAX_RECONNECT_BACKOFF_MS (0: gRPC default)");
+
 using grpc::Channel;
 using grpc::ClientContext;
 using grpc::Status;
@@ -24,33 +50,275 @@ using grpc::ClientWriter;
 using data::GRPCDemo;
 using data::Request;
 using data::Response;
+using data::ResumeRequest;
+using data::ResumeResponse;
 
 uint64_t GetTimeStamp() {  // 直接调用此函数就可以返回时间戳了
   return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch())
       .count();
 }
+const char* StateName(grpc_connectivity_state state) {
+  switch (state) {
+    case GRPC_CHANNEL_IDLE:
+      return "IDLE";
+    case GRPC_CHANNEL_CONNECTING:
+      return "CONNECTING";
+    case GRPC_CHANNEL_READY:
+      return "READY";
+    case GRPC_CHANNEL_TRANSIENT_FAILURE:
+      return "TRANSIENT_FAILURE";
+    case GRPC_CHANNEL_SHUTDOWN:
+      return "SHUTDOWN";
+  }
+  return "UNKNOWN";
+}
+
+// True if a plain TCP connect to `target` ("host:port") is accepted, i.e.
+// a server is listening there again.
+bool Reachable(const std::string& target) {
+  size_t colon = target.rfind(':');
+  if (colon == std::string::npos) {
+    return false;
+  }
+  std::string host = target.substr(0, colon);
+  if (host.size() > 1 && host.front() == '[') {
+    host = host.substr(1, host.size() - 2);
+  }
+  addrinfo hints{};
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* addresses = nullptr;
+  if (getaddrinfo(host.c_str(), target.c_str() + colon + 1, &hints, &addresses) != 0) {
+    return false;
+  }
+  bool reachable = false;
+  for (addrinfo* address = addresses; address != nullptr && !reachable; address = address->ai_next) {
+    int fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    timeval timeout{0, 100 * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    reachable = connect(fd, address->ai_addr, address->ai_addrlen) == 0;
+    close(fd);
+  }
+  freeaddrinfo(addresses);
+  return reachable;
+}
+
+// Follows the channel through NotifyOnStateChange on a completion queue of
+// its own and prints every transition with its time.
+// - time to READY: from the channel leaving READY (the server restarted or
+//   went away) until it is READY again.
+// - reconnect lag: from the first moment a server accepts connections again
+//   until the channel is READY. The channel stays in TRANSIENT_FAILURE while
+//   it backs off between attempts, so the attempts themselves are not
+//   visible; instead the target is probed with plain TCP connects every
+//   10 ms during an outage, and the lag is what the reconnect backoff costs.
+class StateTracker {
+ public:
+  StateTracker(std::shared_ptr<Channel> channel, std::string target) : channel_(channel), target_(target) {
+    thread_ = std::thread(&StateTracker::Run, this);
+  }
+
+  void Stop() {
+    running_ = false;
+    thread_.join();
+  }
+
+  void Report(std::ostream& out) {
+    std::lock_guard<std::mutex> lock(mu_);
+    out << "transitions:" << transitions_ << " outages:" << time_to_ready_.Count() << std::endl;
+    out << "time to READY: ";
+    time_to_ready_.Print(out, 1e6, "ms");
+    out << std::endl << "reconnect lag: ";
+    reconnect_lag_.Print(out, 1e6, "ms");
+    out << std::endl;
+  }
+
+ private:
+  void Run() {
+    grpc::CompletionQueue cq;
+    grpc_connectivity_state last = channel_->GetState(false);
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      state_ = last;
+      std::cout << "channel +0s " << StateName(last) << std::endl;
+    }
+    while (running_) {
+      bool probing;
+      {
+        std::lock_guard<std::mutex> lock(mu_);
+        probing = in_outage_ && !server_back_;
+      }
+      if (probing) {
+        bool reachable = Reachable(target_);
+        std::lock_guard<std::mutex> lock(mu_);
+        // Back only after it was seen gone, the old process may still be
+        // accepting for a moment while it goes away.
+        if (!reachable) {
+          server_gone_ = true;
+        } else if (server_gone_) {
+          server_back_ = true;
+          server_back_at_ = std::chrono::steady_clock::now();
+          std::cout << "channel +" << Since(server_back_at_) << "s server accepts connections" << std::endl;
+        }
+      }
+      // Re-armed every 10 ms during an outage and 100 ms otherwise, so probes
+      // stay frequent and Stop() does not wait for the next change.
+      auto wait = std::chrono::milliseconds(probing ? 10 : 100);
+      channel_->NotifyOnStateChange(last, std::chrono::system_clock::now() + wait, &cq, nullptr);
+      void* tag;
+      bool changed = false;
+      cq.Next(&tag, &changed);
+      if (changed) {
+        // Changes in between the notification and GetState() are folded into
+        // one transition, the API offers no more than that.
+        last = channel_->GetState(false);
+        Record(last);
+      }
+    }
+    cq.Shutdown();
+    void* tag;
+    bool ok;
+    while (cq.Next(&tag, &ok)) {
+    }
+  }
+
+  void Record(grpc_connectivity_state state) {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(mu_);
+    if (state == state_) {
+      return;
+    }
+    std::cout << "channel +" << Since(now) << "s " << StateName(state_) << " -> " << StateName(state) << std::endl;
+    if (state_ == GRPC_CHANNEL_READY) {
+      outage_start_ = now;
+      in_outage_ = true;
+      server_gone_ = false;
+      server_back_ = false;
+    }
+    if (state == GRPC_CHANNEL_READY && in_outage_) {
+      time_to_ready_.Record(Nanos(now - outage_start_));
+      // A restart that never refused a connection (a hot restart) has no lag
+      // to speak of.
+      reconnect_lag_.Record(server_back_ ? Nanos(now - server_back_at_) : 0);
+      in_outage_ = false;
+    }
+    state_ = state;
+    transitions_++;
+  }
+
+  double Since(std::chrono::steady_clock::time_point at) const {
+    return std::chrono::duration<double>(at - start_).count();
+  }
+
+  static double Nanos(std::chrono::steady_clock::duration duration) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+  }
+
+  std::shared_ptr<Channel> channel_;
+  const std::string target_;
+  std::atomic<bool> running_{true};
+  std::thread thread_;
+  std::mutex mu_;
+  const std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
+  grpc_connectivity_state state_ = GRPC_CHANNEL_IDLE;
+  uint64_t transitions_ = 0;
+  bool in_outage_ = false;
+  bool server_gone_ = false;
+  bool server_back_ = false;
+  std::chrono::steady_clock::time_point outage_start_;
+  std::chrono::steady_clock::time_point server_back_at_;
+  histogram time_to_ready_;
+  histogram reconnect_lag_;
+};
+
 class GRPCDemoClient {
  public:
-  GRPCDemoClient(std::shared_ptr<Channel> channel)
-      : stub_(GRPCDemo::NewStub(channel)) {}
+  GRPCDemoClient(std::shared_ptr<Channel> channel, bool wait_for_ready, bool resumable)
+      : stub_(GRPCDemo::NewStub(channel)), wait_for_ready_(wait_for_ready), resumable_(resumable) {
+    std::random_device random;
+    transfer_prefix_ = std::to_string(random()) + std::to_string(random()) + "-";
+  }
+
+  // StreamingMethod, tried again up to `retries` more times when the server
+  // is unavailable or shedding load, with exponential backoff starting at
+  // `backoff`. A resumable upload continues from the offset the server has
+  // committed (asked for with Resume, the last ack if the server cannot
+  // tell), otherwise it starts over from the beginning of the buffer.
+  Status StreamingMethodWithRetry(int length, char* data, int retries, std::chrono::milliseconds backoff) {
+    std::string transfer_id = resumable_ ? transfer_prefix_ + std::to_string(next_transfer_++) : "";
+    uint64_t from = 0, acked = 0;
+    Status status = StreamingMethod(length, data, transfer_id, from, &acked);
+    int attempt = 0;
+    while (!status.ok() && attempt < retries && Retryable(status)) {
+      std::this_thread::sleep_for(backoff * (1 << attempt));
+      attempt++;
+      retries_++;
+      if (resumable_) {
+        status = Resume(transfer_id, length, &from);
+        if (status.error_code() == grpc::StatusCode::UNIMPLEMENTED) {
+          from = acked;
+        } else if (status.error_code() == grpc::StatusCode::NOT_FOUND) {
+          from = 0;  // nothing was staged, start over
+        } else if (!status.ok()) {
+          continue;
+        }
+        resumed_bytes_ += from;
+        if (from == uint64_t(length)) {
+          status = Status::OK;  // only the last ack was lost
+          break;
+        }
+      }
+      status = StreamingMethod(length, data, transfer_id, from, &acked);
+    }
+    calls_++;
+    payload_bytes_ += length;
+    if (!status.ok()) {
+      failed_++;
+    } else if (attempt > 0) {
+      retried_++;
+    }
+    return status;
+  }
 
+  void Report(std::ostream& out) const {
+    out << "calls:" << calls_ << " ok first try:" << calls_ - retried_ - failed_ << " ok after retry:" << retried_
+        << " failed:" << failed_ << " retries:" << retries_ << std::endl;
+    out << "payload:" << payload_bytes_ / 1024 / 1024 << "MB sent:" << sent_bytes_ / 1024 / 1024
+        << "MB not resent thanks to resume:" << resumed_bytes_ / 1024 / 1024 << "MB" << std::endl;
+  }
 
-  std::string StreamingMethod(int length,char * data) {
+  // Uploads `data` from `from` on. With a `transfer_id` every Request carries
+  // the id, its offset, size and CRC32C, and `acked` follows the committed
+  // offset the server acks.
+  Status StreamingMethod(int length, char* data, const std::string& transfer_id = "", uint64_t from = 0,
+                         uint64_t* acked = nullptr) {
     ClientContext context;
+    context.set_wait_for_ready(wait_for_ready_);
 
     std::shared_ptr<ClientReaderWriter<Request, Response> > stream(
         stub_->StreamingMethod(&context));
     std::thread writer([&,stream]() {
       std::vector<Request> requests;
-      int left=0;
+      int left=from;
       int maxlength=1024*1024*3;
-      int right=length<maxlength?length:maxlength;
+      int right=length<left+maxlength?length:left+maxlength;
       int id=0;
       while(left<length){
         std::string string_data (data+left, data+right);
         Request req;
         req.set_data(string_data);
-        stream->Write(req);
+        if (!transfer_id.empty()) {
+          req.set_transfer_id(transfer_id);
+          req.set_offset(left);
+          req.set_total_size(length);
+          req.set_crc32c(crc32c::Value(string_data.data(), string_data.size()));
+        }
+        sent_bytes_ += string_data.size();
+        if (!stream->Write(req)) {
+          break;  // the stream is broken, Finish() tells why
+        }
         left=right;
         right=length<left+maxlength?length:left+maxlength;
         id++;
@@ -63,6 +331,9 @@ class GRPCDemoClient {
     double recv_length=0;
     while (stream->Read(&server_reply)) {
       recv_length+=server_reply.data().length();
+      if (acked != nullptr) {
+        *acked = std::max<uint64_t>(*acked, server_reply.committed_offset());
+      }
     }
     writer.join();
     std::cout << "===streaming client recv::"<<recv_length/1024/1024<<" MB" << std::endl;
@@ -70,7 +341,7 @@ class GRPCDemoClient {
     if (!status.ok()) {
       std::cout << "stream rpc failed." << std::endl;
     }
-    return "stream end\n";
+    return status;
   }
 
 
@@ -92,7 +363,48 @@ class GRPCDemoClient {
   }
 
  private:
+  // Failures a later attempt can get past. DATA_LOSS (a chunk failed its
+  // checksum) and FAILED_PRECONDITION (a gap) only for resumable uploads,
+  // which continue from the committed offset.
+  bool Retryable(const Status& status) const {
+    switch (status.error_code()) {
+      case grpc::StatusCode::UNAVAILABLE:
+      case grpc::StatusCode::RESOURCE_EXHAUSTED:
+        return true;
+      case grpc::StatusCode::DATA_LOSS:
+      case grpc::StatusCode::FAILED_PRECONDITION:
+        return resumable_;
+      default:
+        return false;
+    }
+  }
+
+  Status Resume(const std::string& transfer_id, int length, uint64_t* committed) {
+    ClientContext context;
+    context.set_wait_for_ready(wait_for_ready_);
+    ResumeRequest request;
+    request.set_transfer_id(transfer_id);
+    request.set_total_size(length);
+    ResumeResponse response;
+    Status status = stub_->Resume(&context, request, &response);
+    if (status.ok()) {
+      *committed = response.committed_offset();
+    }
+    return status;
+  }
+
   std::unique_ptr<GRPCDemo::Stub> stub_;
+  bool wait_for_ready_;
+  bool resumable_;
+  std::string transfer_prefix_;
+  std::atomic<uint64_t> next_transfer_{0};
+  std::atomic<uint64_t> payload_bytes_{0};
+  std::atomic<uint64_t> sent_bytes_{0};
+  std::atomic<uint64_t> resumed_bytes_{0};
+  std::atomic<uint64_t> calls_{0};
+  std::atomic<uint64_t> retried_{0};
+  std::atomic<uint64_t> failed_{0};
+  std::atomic<uint64_t> retries_{0};
 };
 void channelState(std::shared_ptr<grpc::Channel> channel){
   auto channel_state = channel->GetState(true);
@@ -112,55 +424,55 @@ void channelState(std::shared_ptr<grpc::Channel> channel){
 int main(int argc, char** argv) {
   // Instantiate the client. It requires a channel, out of which the actual RPCs
   // are created. This channel models a connection to an endpoint specified by
-  // the argument "--target=" which is the only expected argument.
+  // the argument "--target=".
   // We indicate that the channel isn't authenticated (use of
   // InsecureChannelCredentials()).
-  std::string target_str;
-  std::string arg_str("--target");
-  if (argc > 1) {
-    std::string arg_val = argv[1];
-    size_t start_pos = arg_val.find(arg_str);
-    if (start_pos != std::string::npos) {
-      start_pos += arg_str.size();
-      if (arg_val[start_pos] == '=') {
-        target_str = arg_val.substr(start_pos + 1);
-      } else {
-        std::cout << "The only correct argument syntax is --target="
-                  << std::endl;
-        return 0;
-      }
-    } else {
-      std::cout << "The only acceptable argument is --target=" << std::endl;
-      return 0;
-    }
-  } else {
-    target_str = "localhost:50051";
-  }
-  thread_pool pool(5);
+  absl::ParseCommandLine(argc, argv);
+  std::string target_str = absl::GetFlag(FLAGS_target);
+  int rounds = absl::GetFlag(FLAGS_rounds);
+  int tasks = absl::GetFlag(FLAGS_tasks);
+  int length = absl::GetFlag(FLAGS_size_mb) * 1024 * 1024;
+  int retries = absl::GetFlag(FLAGS_retries);
+  std::chrono::milliseconds retry_backoff(absl::GetFlag(FLAGS_retry_backoff_ms));
+  bool work_stealing = absl::GetFlag(FLAGS_work_stealing);
+  thread_pool pool(5, work_stealing ? thread_pool::schedule::work_stealing : thread_pool::schedule::pinned);
   grpc::ChannelArguments ch_args;  // mydebug grpc max message;
   ch_args.SetMaxReceiveMessageSize(-1);
   ch_args.SetMaxSendMessageSize(-1);
+  if (absl::GetFlag(FLAGS_initial_backoff_ms) > 0) {
+    ch_args.SetInt(GRPC_ARG_INITIAL_RECONNECT_BACKOFF_MS, absl::GetFlag(FLAGS_initial_backoff_ms));
+  }
+  if (absl::GetFlag(FLAGS_min_backoff_ms) > 0) {
+    ch_args.SetInt(GRPC_ARG_MIN_RECONNECT_BACKOFF_MS, absl::GetFlag(FLAGS_min_backoff_ms));
+  }
+  if (absl::GetFlag(FLAGS_max_backoff_ms) > 0) {
+    ch_args.SetInt(GRPC_ARG_MAX_RECONNECT_BACKOFF_MS, absl::GetFlag(FLAGS_max_backoff_ms));
+  }
   auto  channel = grpc::CreateCustomChannel(target_str, grpc::InsecureChannelCredentials(), ch_args);
-  GRPCDemoClient GRPCDemo(channel);
+  GRPCDemoClient GRPCDemo(channel, absl::GetFlag(FLAGS_wait_for_ready), absl::GetFlag(FLAGS_resumable));
+  StateTracker tracker(channel, target_str);
   channelState(channel);
   
+  auto one_upload = [length,retries,retry_backoff,&GRPCDemo]{
+    char * data =new char[length];
+    GRPCDemo.StreamingMethodWithRetry(length,data,retries,retry_backoff);
+    delete []data;
+  };
+  std::vector<decltype(one_upload)> batch(tasks, one_upload);
   //while(true){
-  for(auto index=0;index<300;++index){
+  for(auto index=0;index<rounds;++index){
     if(index%1==0){
       std::cout<<"index:"<<index<<std::endl;
       channelState(channel);
     }
-    for (int i=0;i<20;++i){
-        pool.push_task([target_str,&GRPCDemo]{
-          int length=100*1024*1024;//100MB
-          char * data =new char[length];
-          std::string reply = GRPCDemo.StreamingMethod(length,data);
-          delete []data;
-      },i%5);
-  }
-  pool.wait_for_tasks();
+    task_latch round;
+    pool.push_batch(batch, &round);
+    round.wait();
   }
   channelState(channel);//get channel state;
+  tracker.Stop();
+  GRPCDemo.Report(std::cout);
+  tracker.Report(std::cout);
   // Create a Shutdown request
   channel.reset();//close channel;
   return 0;
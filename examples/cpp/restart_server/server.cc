@@ -16,10 +16,21 @@
  *
  */
 
+#include <pthread.h>
+#include <signal.h>
+
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/strings/str_format.h"
+
 #include <grpcpp/ext/proto_server_reflection_plugin.h>
 #include <grpcpp/grpcpp.h>
 #include <grpcpp/health_check_service_interface.h>
@@ -30,6 +41,26 @@
 #include "data.grpc.pb.h"
 #endif
 
+#include "examples/cpp/streaming/admission.hpp"
+#include "examples/cpp/streaming/byte_budget.hpp"
+#include "staging.hpp"
+
+ABSL_FLAG(uint16_t, port, 50051, "Server port for the service");
+ABSL_FLAG(uint32_t, restart_seconds, 20, "hot restart the server this often (0: never)");
+ABSL_FLAG(uint32_t, drain_seconds, 60, "how long a stopping server lets calls in flight finish");
+ABSL_FLAG(uint32_t, quota_mb, 0, "grpc::ResourceQuota memory limit for the whole server (0: unlimited)");
+ABSL_FLAG(uint32_t, max_threads, 0, "grpc::ResourceQuota thread limit, caps the sync server's threads (0: unlimited)");
+ABSL_FLAG(uint32_t, max_concurrent_streams, 0, "HTTP/2 MAX_CONCURRENT_STREAMS per connection (0: unlimited)");
+ABSL_FLAG(uint32_t, max_active_streams, 0, "StreamingMethod calls running at once, the rest queue or are shed (0: unlimited)");
+ABSL_FLAG(uint32_t, max_queued_streams, 0, "StreamingMethod calls waiting for a slot (0: unlimited)");
+ABSL_FLAG(uint32_t, queue_timeout_ms, 0, "how long a call waits for a slot before RESOURCE_EXHAUSTED (0: shed at once)");
+ABSL_FLAG(uint32_t, stream_budget_mb, 0, "largest Request a stream may receive, the max receive message size (0: unlimited)");
+ABSL_FLAG(uint32_t, held_budget_mb, 0, "payload bytes all handlers together may hold, a stream waits for room (0: unlimited)");
+ABSL_FLAG(std::string, staging_dir, "/tmp/restart_server_staging", "where resumable transfers are staged");
+ABSL_FLAG(bool, sync_commits, false, "msync every committed chunk, so it survives the machine and not only the process");
+ABSL_FLAG(uint32_t, staging_ttl_s, 3600, "partial transfers untouched for this long are removed");
+ABSL_FLAG(uint32_t, max_transfer_mb, 4096, "largest resumable transfer staged, its file is sized up front (0: any)");
+
 using grpc::Server;
 using grpc::ServerBuilder;
 using grpc::ServerContext;
@@ -40,24 +71,79 @@ using grpc::ServerReaderWriter;
 using data::GRPCDemo;
 using data::Request;
 using data::Response;
+using data::ResumeRequest;
+using data::ResumeResponse;
+using staging::StagingArea;
+using staging::StagingFile;
 using namespace std;
 // Logic and data behind the server's behavior.
 class GRPCDemoServiceImpl final : public GRPCDemo::Service {
+ public:
+  // Admission control, the budget for payload held by handlers and the
+  // staged transfers, all process wide: they outlive the server instances
+  // RunServer cycles through.
+  GRPCDemoServiceImpl(Admission* admission, ByteBudget* held_budget, StagingArea* staging)
+      : admission_(admission), held_budget_(held_budget), staging_(staging) {}
+
+ private:
   Status StreamingMethod(ServerContext* context, ServerReaderWriter<Response,Request>* stream) override {
+    if (!admission_->Enter()) {
+      return Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "too many streams, retry later");
+    }
     Request req;
     int id=0;
     double total_length=0;
-    while (stream->Read(&req)) {
+    std::shared_ptr<StagingFile> staged;
+    Status status;
+    while (status.ok() && stream->Read(&req)) {
       Response reply;
+      // The Request and its copy are held until the reply is written.
+      int64_t held = 2 * req.data().size();
+      held_budget_->Acquire(held);
       std::string string_data (req.data());
+      if (!req.transfer_id().empty()) {
+        status = Stage(req, &staged, &reply);
+      }
       //reply.set_data(string_data);
       reply.set_data("");
-      stream->Write(reply);
+      if (status.ok()) {
+        stream->Write(reply);
+      }
       total_length+=string_data.length();
       id++;
+      held_budget_->Release(held);
+    }
+    admission_->Leave();
+    if (staged) {
+      staging_->Finish(staged);
     }
     cout<<"=== server streaming recv&send:"<<total_length/1024/1024 <<" MB"<<endl;
-    return Status::OK;
+    return status;
+  }
+
+  // A chunk of a resumable transfer: staged, and acked with the committed
+  // offset. A failed chunk ends the stream, the client resumes from there.
+  Status Stage(const Request& req, std::shared_ptr<StagingFile>* staged, Response* reply) {
+    if (!*staged) {
+      Status status = staging_->Open(req.transfer_id(), req.total_size(), staged);
+      if (!status.ok()) {
+        return status;
+      }
+    } else if ((*staged)->Id() != req.transfer_id()) {
+      return Status(grpc::StatusCode::INVALID_ARGUMENT, "one transfer per stream");
+    }
+    uint64_t committed = 0;
+    Status status = (*staged)->Commit(req.offset(), req.data(), req.crc32c(), &committed);
+    reply->set_committed_offset(committed);
+    return status;
+  }
+
+  Status Resume(ServerContext* context, const ResumeRequest* request, ResumeResponse* response) override {
+    uint64_t committed = 0;
+    Status status = staging_->Committed(request->transfer_id(), request->total_size(), &committed);
+    response->set_committed_offset(committed);
+    cout<<"=== server resume "<<request->transfer_id()<<" at:"<<committed/1024/1024<<" MB"<<endl;
+    return status;
   }
 
   Status UnaryMethod(ServerContext* context, const Request *request,Response *reply) override {
@@ -66,41 +152,172 @@ class GRPCDemoServiceImpl final : public GRPCDemo::Service {
     cout<<"=== server unary recv&send:"<<reply->data().size()/1024/1024 <<" MB"<<endl;
     return Status::OK;
   }
+
+  Admission* admission_;
+  ByteBudget* held_budget_;
+  StagingArea* staging_;
+};
+struct ServerOptions {
+  uint16_t port;
+  uint32_t restart_seconds;
+  uint32_t drain_seconds;
+  uint32_t quota_mb;
+  uint32_t max_threads;
+  uint32_t max_concurrent_streams;
+  uint32_t max_active_streams;
+  uint32_t max_queued_streams;
+  uint32_t queue_timeout_ms;
+  uint32_t stream_budget_mb;
+  uint32_t held_budget_mb;
+  std::string staging_dir;
+  bool sync_commits;
+  uint32_t staging_ttl_s;
+  uint32_t max_transfer_mb;
 };
-void doShutdown(std::unique_ptr<Server>& server)
-{   
-    sleep(20);//seconds
-    server->Shutdown();        
-    std::cout << "Server is shutting down. "<< std::endl;
-}
 
-void RunServer() {
-  while(true){
-    std::string server_address("0.0.0.0:50051");
-    GRPCDemoServiceImpl service;
-    grpc::EnableDefaultHealthCheckService(true);
-    grpc::reflection::InitProtoReflectionServerBuilderPlugin();
-    ServerBuilder builder;
+// Set from the signal thread when SIGTERM/SIGINT arrives.
+std::mutex stop_mutex;
+std::condition_variable stop_condition;
+bool stop_requested = false;
+
+// Builds and starts one server generation on the configured port. The port
+// is opened with SO_REUSEPORT, so a generation can start listening while the
+// previous one still owns it.
+std::unique_ptr<Server> BuildServer(const ServerOptions& options, GRPCDemoServiceImpl* service) {
+  std::string server_address = absl::StrFormat("0.0.0.0:%d", options.port);
+  grpc::EnableDefaultHealthCheckService(true);
+  grpc::reflection::InitProtoReflectionServerBuilderPlugin();
+  ServerBuilder builder;
+  if (options.stream_budget_mb > 0) {
+    builder.SetMaxReceiveMessageSize(options.stream_budget_mb * 1024 * 1024);
+  } else {
     builder.SetMaxReceiveMessageSize(-1);  // mydebug server set max message size;
-    builder.SetMaxSendMessageSize(-1);
-    // Listen on the given address without any authentication mechanism.
-    builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
-    // Register "service" as the instance through which we'll communicate with
-    // clients. In this case it corresponds to an *synchronous* service.
-    builder.RegisterService(&service);
-    // Finally assemble the server.
-    std::unique_ptr<Server> server(builder.BuildAndStart());
+  }
+  builder.SetMaxSendMessageSize(-1);
+  // Same limits as examples/cpp/streaming/server.cc.
+  grpc::ResourceQuota quota("data_server");
+  if (options.quota_mb > 0) {
+    quota.Resize(size_t(options.quota_mb) * 1024 * 1024);
+  }
+  if (options.max_threads > 0) {
+    quota.SetMaxThreads(options.max_threads);
+  }
+  builder.SetResourceQuota(quota);
+  if (options.max_concurrent_streams > 0) {
+    builder.AddChannelArgument(GRPC_ARG_MAX_CONCURRENT_STREAMS, options.max_concurrent_streams);
+  }
+  builder.AddChannelArgument(GRPC_ARG_ALLOW_REUSEPORT, 1);
+  // Listen on the given address without any authentication mechanism.
+  builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
+  // Register "service" as the instance through which we'll communicate with
+  // clients. In this case it corresponds to an *synchronous* service.
+  builder.RegisterService(service);
+  // Finally assemble the server.
+  std::unique_ptr<Server> server(builder.BuildAndStart());
+  if (server) {
     std::cout << "Server listening on " << server_address << std::endl;
-    std::thread task_monitor = std::thread([&] { doShutdown(server); });
-    task_monitor.detach();
-    // Wait for the server to shutdown. Note that some other thread must be
-    // responsible for shutting down the server for this call to ever return.
-    server->Wait();
   }
+  return server;
+}
+
+// Stops a generation without cutting calls off: Shutdown() closes its
+// listener, sends GOAWAY on its connections so clients move new calls to the
+// other listener, and waits for the calls in flight until the deadline, after
+// which the stragglers are cancelled.
+void Drain(std::unique_ptr<Server> server, std::unique_ptr<GRPCDemoServiceImpl> service, Admission& admission,
+           std::chrono::seconds deadline) {
+  auto start = std::chrono::steady_clock::now();
+  size_t in_flight = admission.Active();
+  server->Shutdown(std::chrono::system_clock::now() + deadline);
+  server.reset();
+  service.reset();
+  std::cout << "Server drained, streams in flight:" << in_flight << " took:"
+            << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count()
+            << "ms" << std::endl;
+}
+
+// Recycles the server every `restart_seconds` with zero failed calls: the
+// replacement is listening before the old generation drains, so there is no
+// moment without a listener. SIGTERM/SIGINT drain the current generation and
+// return; a deployer can hand over between processes the same way by
+// starting the new one on the same port before signalling the old one.
+void RunServer(const ServerOptions& options) {
+  Admission admission(options.max_active_streams, options.max_queued_streams,
+                      std::chrono::milliseconds(options.queue_timeout_ms));
+  ByteBudget held_budget(size_t(options.held_budget_mb) * 1024 * 1024);
+  StagingArea staging(options.staging_dir, options.sync_commits, std::chrono::seconds(options.staging_ttl_s),
+                      uint64_t(options.max_transfer_mb) * 1024 * 1024);
+  staging.Expire();
+  std::unique_ptr<GRPCDemoServiceImpl> service(new GRPCDemoServiceImpl(&admission, &held_budget, &staging));
+  std::unique_ptr<Server> server = BuildServer(options, service.get());
+  if (!server) {
+    std::cout << "Server failed to start on port " << options.port << std::endl;
+    return;
+  }
+  std::chrono::seconds restart(options.restart_seconds);
+  std::chrono::seconds drain(options.drain_seconds);
+  while(true){
+    {
+      std::unique_lock<std::mutex> lock(stop_mutex);
+      if (restart.count() > 0) {
+        stop_condition.wait_for(lock, restart, [] { return stop_requested; });
+      } else {
+        stop_condition.wait(lock, [] { return stop_requested; });
+      }
+      if (stop_requested) {
+        break;
+      }
+    }
+    staging.Expire();
+    std::unique_ptr<GRPCDemoServiceImpl> next_service(new GRPCDemoServiceImpl(&admission, &held_budget, &staging));
+    std::unique_ptr<Server> next = BuildServer(options, next_service.get());
+    if (!next) {
+      std::cout << "Server restart failed, keeping the running one" << std::endl;
+      continue;
+    }
+    std::cout << "Server is restarting. "<< std::endl;
+    Drain(std::move(server), std::move(service), admission, drain);
+    server = std::move(next);
+    service = std::move(next_service);
+  }
+  std::cout << "Server is shutting down. "<< std::endl;
+  Drain(std::move(server), std::move(service), admission, drain);
 }
 
 int main(int argc, char** argv) {
-  RunServer();
+  absl::ParseCommandLine(argc, argv);
+  // Block the stop signals before gRPC starts its threads, so they are only
+  // ever delivered to the sigwait() below.
+  sigset_t stop_signals;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGTERM);
+  sigaddset(&stop_signals, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+  std::thread([stop_signals] {
+    int signal = 0;
+    sigwait(&stop_signals, &signal);
+    std::lock_guard<std::mutex> lock(stop_mutex);
+    stop_requested = true;
+    stop_condition.notify_all();
+  }).detach();
+
+  ServerOptions options;
+  options.port = absl::GetFlag(FLAGS_port);
+  options.restart_seconds = absl::GetFlag(FLAGS_restart_seconds);
+  options.drain_seconds = absl::GetFlag(FLAGS_drain_seconds);
+  options.quota_mb = absl::GetFlag(FLAGS_quota_mb);
+  options.max_threads = absl::GetFlag(FLAGS_max_threads);
+  options.max_concurrent_streams = absl::GetFlag(FLAGS_max_concurrent_streams);
+  options.max_active_streams = absl::GetFlag(FLAGS_max_active_streams);
+  options.max_queued_streams = absl::GetFlag(FLAGS_max_queued_streams);
+  options.queue_timeout_ms = absl::GetFlag(FLAGS_queue_timeout_ms);
+  options.stream_budget_mb = absl::GetFlag(FLAGS_stream_budget_mb);
+  options.held_budget_mb = absl::GetFlag(FLAGS_held_budget_mb);
+  options.staging_dir = absl::GetFlag(FLAGS_staging_dir);
+  options.sync_commits = absl::GetFlag(FLAGS_sync_commits);
+  options.staging_ttl_s = absl::GetFlag(FLAGS_staging_ttl_s);
+  options.max_transfer_mb = absl::GetFlag(FLAGS_max_transfer_mb);
+  RunServer(options);
 
   return 0;
 }
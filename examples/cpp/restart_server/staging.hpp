@@ -0,0 +1,316 @@
+#pragma once
+/**
+ * @file staging.hpp
+ * @brief Partial uploads of the resumable transfer protocol, kept in memory
+ * mapped staging files so they outlive a dropped stream and a server restart.
+ * @details Transfer `id` of `size` bytes is staged in `<dir>/<id>.part`: a
+ * 4 KB header (magic, size, committed offset) followed by the payload, the
+ * whole file mapped shared.
+ * - A chunk is only committed at the committed offset (bytes before it that
+ *   were sent again are skipped, a gap is refused) and only if its CRC32C
+ *   matches. Its bytes are copied into the mapping before the header's
+ *   offset moves, so a process dying in between leaves the previous offset,
+ *   never one covering bytes that are not there.
+ * - Written pages belong to the page cache, not to the process: every few MB
+ *   the committed range is unmapped again (MADV_DONTNEED keeps the data of a
+ *   shared file mapping), so a 100 MB upload does not add 100 MB of rss.
+ * - With `sync` every commit is msync()ed and also survives the machine going
+ *   down; otherwise it survives the process.
+ * A complete transfer's file is removed, this demo has no consumer for it;
+ * the ids of the last completed ones are remembered so a client that lost
+ * the final ack learns it is done. Partial files nobody touched for `ttl` are
+ * removed by Expire(). Only a chunk creates a staging file, and no larger
+ * than `max_size`: the size comes from the client.
+ */
+
+#include <dirent.h>    // opendir, readdir
+#include <fcntl.h>     // open
+#include <sys/mman.h>  // mmap, msync, madvise
+#include <sys/stat.h>  // fstat, mkdir
+#include <unistd.h>    // ftruncate, unlink, close
+
+#include <atomic>   // std::atomic_thread_fence
+#include <cctype>   // isalnum
+#include <cerrno>   // errno, ENOENT
+#include <chrono>   // std::chrono
+#include <cstdint>  // std::uint64_t
+#include <cstring>  // std::memcpy
+#include <deque>    // std::deque
+#include <map>      // std::map
+#include <memory>   // std::shared_ptr, std::weak_ptr
+#include <mutex>    // std::mutex, std::lock_guard
+#include <set>      // std::set
+#include <string>   // std::string
+
+#include <grpcpp/grpcpp.h>
+
+#include "crc32c.hpp"
+
+namespace staging {
+
+class StagingFile {
+  typedef std::uint64_t ui64;
+
+ public:
+  static constexpr size_t kHeaderSize = 4096;
+  static constexpr ui64 kMagic = 0x31474e4947415453;  // "STAGING1"
+  static constexpr size_t kReleaseBytes = 8 << 20;
+
+  struct Header {
+    ui64 magic;
+    ui64 size;
+    ui64 committed;
+  };
+
+  StagingFile(std::string id, std::string path, int fd, char *map, ui64 size, bool sync)
+      : id(std::move(id)), path(std::move(path)), fd(fd), map(map), size(size), sync(sync) {
+    released = Committed() / kReleaseBytes * kReleaseBytes;
+  }
+
+  ~StagingFile() {
+    munmap(map, kHeaderSize + size);
+    close(fd);
+  }
+
+  /**
+   * @brief Commit `data`, which starts at `offset` of the transfer. Sets
+   * `committed` to the committed offset either way.
+   */
+  grpc::Status Commit(ui64 offset, const std::string &data, std::uint32_t crc, ui64 *committed) {
+    bool intact = crc32c::Value(data.data(), data.size()) == crc;
+    std::lock_guard<std::mutex> lock(mutex);
+    Header *header = reinterpret_cast<Header *>(map);
+    *committed = header->committed;
+    if (!intact) {
+      return grpc::Status(grpc::StatusCode::DATA_LOSS, "chunk fails its crc32c, resume from the committed offset");
+    }
+    if (offset > size || data.size() > size - offset) {
+      return grpc::Status(grpc::StatusCode::OUT_OF_RANGE, "chunk runs past total_size");
+    }
+    if (offset > header->committed) {
+      return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION,
+                          "chunk leaves a gap, resume from the committed offset");
+    }
+    ui64 end = offset + data.size();
+    if (end <= header->committed) {
+      return grpc::Status::OK;  // sent again after a resume, already here
+    }
+    char *payload = map + kHeaderSize;
+    std::memcpy(payload + header->committed, data.data() + (header->committed - offset), end - header->committed);
+    if (sync) {
+      Sync(header->committed, end);
+    }
+    // The data is in place before the offset says so.
+    std::atomic_thread_fence(std::memory_order_release);
+    header->committed = end;
+    if (sync) {
+      msync(map, kHeaderSize, MS_SYNC);
+    }
+    *committed = end;
+    if (end - released >= kReleaseBytes || end == size) {
+      ui64 upto = end == size ? end : end / kReleaseBytes * kReleaseBytes;
+      madvise(payload + released, upto - released, MADV_DONTNEED);
+      released = upto;
+    }
+    return grpc::Status::OK;
+  }
+
+  ui64 Committed() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return reinterpret_cast<Header *>(map)->committed;
+  }
+
+  bool Complete() { return Committed() == size; }
+
+  const std::string &Id() const { return id; }
+  const std::string &Path() const { return path; }
+  ui64 Size() const { return size; }
+
+ private:
+  // msync() wants a page aligned start.
+  void Sync(ui64 begin, ui64 end) {
+    ui64 page = ui64(sysconf(_SC_PAGESIZE));
+    ui64 start = (kHeaderSize + begin) / page * page;
+    msync(map + start, kHeaderSize + end - start, MS_SYNC);
+  }
+
+  const std::string id;
+  const std::string path;
+  const int fd;
+  char *const map;
+  const ui64 size;
+  const bool sync;
+  std::mutex mutex;
+  ui64 released = 0;  // payload before this is not mapped in any more
+};
+
+class StagingArea {
+  typedef std::uint64_t ui64;
+
+ public:
+  /**
+   * @param max_size largest transfer staged, 0 for any.
+   */
+  StagingArea(std::string dir, bool sync, std::chrono::seconds ttl, ui64 max_size)
+      : dir(std::move(dir)), sync(sync), ttl(ttl), max_size(max_size) {
+    mkdir(this->dir.c_str(), 0755);
+  }
+
+  /**
+   * @brief The staging file of transfer `id`, picking up what an earlier
+   * stream or process committed. Without `create`, NOT_FOUND unless such a
+   * file is there already.
+   */
+  grpc::Status Open(const std::string &id, ui64 size, std::shared_ptr<StagingFile> *file, bool create = true) {
+    if (!ValidId(id)) {
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "transfer_id must be 1-128 of [A-Za-z0-9._-]");
+    }
+    if (max_size > 0 && size > max_size) {
+      return grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "transfer too large");
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    auto open = files.find(id);
+    if (open != files.end()) {
+      if ((*file = open->second.lock())) {
+        if ((*file)->Size() != size) {
+          return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "total_size differs from the transfer's");
+        }
+        return grpc::Status::OK;
+      }
+      files.erase(open);
+    }
+    std::string path = dir + "/" + id + ".part";
+    int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+    if (fd < 0) {
+      if (!create && errno == ENOENT) {
+        return grpc::Status(grpc::StatusCode::NOT_FOUND, "no staged transfer " + id);
+      }
+      return grpc::Status(grpc::StatusCode::INTERNAL, "cannot open " + path);
+    }
+    struct stat st;
+    StagingFile::Header header{};
+    bool reuse = fstat(fd, &st) == 0 && ui64(st.st_size) == StagingFile::kHeaderSize + size &&
+                 pread(fd, &header, sizeof(header), 0) == sizeof(header) && header.magic == StagingFile::kMagic &&
+                 header.size == size && header.committed <= size;
+    if (!reuse && !create) {
+      close(fd);
+      return grpc::Status(grpc::StatusCode::NOT_FOUND, "no staged transfer " + id + " of this size");
+    }
+    if (!reuse) {
+      // New, or left behind by something else: start over.
+      header = StagingFile::Header{StagingFile::kMagic, size, 0};
+      if (ftruncate(fd, 0) != 0 || ftruncate(fd, StagingFile::kHeaderSize + size) != 0 ||
+          pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        close(fd);
+        return grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "cannot size " + path);
+      }
+    }
+    void *map = mmap(nullptr, StagingFile::kHeaderSize + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+      close(fd);
+      return grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "cannot map " + path);
+    }
+    // The payload is written front to back exactly once.
+    madvise(static_cast<char *>(map) + StagingFile::kHeaderSize, size, MADV_SEQUENTIAL);
+    *file = std::make_shared<StagingFile>(id, path, fd, static_cast<char *>(map), size, sync);
+    files[id] = *file;
+    return grpc::Status::OK;
+  }
+
+  /**
+   * @brief Committed offset of transfer `id`, for the Resume RPC. A transfer
+   * completed lately reports its size, one never staged NOT_FOUND.
+   */
+  grpc::Status Committed(const std::string &id, ui64 size, ui64 *committed) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (completed.count(id)) {
+        *committed = size;
+        return grpc::Status::OK;
+      }
+    }
+    std::shared_ptr<StagingFile> file;
+    grpc::Status status = Open(id, size, &file, false);
+    if (status.ok()) {
+      *committed = file->Committed();
+    }
+    return status;
+  }
+
+  /**
+   * @brief A stream of `file` ended. Removes the file if it is complete.
+   */
+  void Finish(const std::shared_ptr<StagingFile> &file) {
+    if (!file->Complete()) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if (completed.insert(file->Id()).second) {
+      completed_order.push_back(file->Id());
+      if (completed_order.size() > kRememberCompleted) {
+        completed.erase(completed_order.front());
+        completed_order.pop_front();
+      }
+    }
+    files.erase(file->Id());
+    unlink(file->Path().c_str());
+  }
+
+  /**
+   * @brief Remove partial files not in use and untouched for `ttl`. Returns
+   * how many.
+   */
+  size_t Expire() {
+    std::lock_guard<std::mutex> lock(mutex);
+    DIR *directory = opendir(dir.c_str());
+    if (directory == nullptr) {
+      return 0;
+    }
+    size_t removed = 0;
+    auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+    while (dirent *entry = readdir(directory)) {
+      std::string name = entry->d_name;
+      if (name.size() <= 5 || name.compare(name.size() - 5, 5, ".part") != 0) {
+        continue;
+      }
+      auto open = files.find(name.substr(0, name.size() - 5));
+      if (open != files.end() && !open->second.expired()) {
+        continue;
+      }
+      std::string path = dir + "/" + name;
+      struct stat st;
+      if (stat(path.c_str(), &st) == 0 && now - st.st_mtime > ttl.count() && unlink(path.c_str()) == 0) {
+        removed++;
+      }
+    }
+    closedir(directory);
+    return removed;
+  }
+
+ private:
+  static constexpr size_t kRememberCompleted = 4096;
+
+  // The id names a file.
+  static bool ValidId(const std::string &id) {
+    if (id.empty() || id.size() > 128 || id[0] == '.') {
+      return false;
+    }
+    for (char c : id) {
+      if (!isalnum(static_cast<unsigned char>(c)) && c != '.' && c != '_' && c != '-') {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  const std::string dir;
+  const bool sync;
+  const std::chrono::seconds ttl;
+  const ui64 max_size;
+  std::mutex mutex;
+  std::map<std::string, std::weak_ptr<StagingFile>> files;
+  std::set<std::string> completed;
+  std::deque<std::string> completed_order;
+};
+
+}  // namespace staging
@@ -0,0 +1,70 @@
+#pragma once
+/**
+ * @file ack_policy.hpp
+ * @brief When the streaming server acks: one Response per N Requests, per M
+ * payload bytes or per interval, instead of one per Request.
+ * @details Every Response carries `acked_bytes`, the payload bytes of the call
+ * received so far, so an ack covers all the Requests before it and the client
+ * keeps its acked offset whichever acks it gets. Besides the thresholds an ack
+ * goes out
+ * - for a Request with `ack_now` set: a sender that stopped writing until
+ *   acks free its budget asks for one instead of waiting for a threshold it
+ *   will never reach;
+ * - for whatever is left unacked when the stream ends.
+ * The interval is checked as Requests arrive, a stream that goes quiet is not
+ * acked before it sends again or ends (which is what `ack_now` is for). The
+ * limits are OR'ed, so a count limit also set caps a byte or time limit; the
+ * defaults ack every Request, as before.
+ */
+
+#include <chrono>   // std::chrono
+#include <cstddef>  // size_t
+#include <cstdint>  // std::uint32_t, std::uint64_t
+
+struct AckOptions {
+  std::uint32_t messages = 1;  // Requests per ack, 0: no limit
+  size_t bytes = 0;            // payload bytes per ack, 0: no limit
+  std::chrono::milliseconds interval{0};  // longest time between acks, 0: no limit
+  bool buffer_hint = false;  // write acks with buffer_hint: sent with the next write
+};
+
+class AckPolicy {
+  using Clock = std::chrono::steady_clock;
+
+ public:
+  explicit AckPolicy(const AckOptions &options) : options(options), last_ack(Clock::now()) {}
+
+  /**
+   * @brief A Request with `n` payload bytes arrived. True if it is to be acked
+   * now, with Ack().
+   */
+  bool Received(size_t n, bool ack_now) {
+    received += n;
+    messages++;
+    if (ack_now || (options.messages > 0 && messages >= options.messages) ||
+        (options.bytes > 0 && received - acked >= options.bytes)) {
+      return true;
+    }
+    return options.interval.count() > 0 && Clock::now() - last_ack >= options.interval;
+  }
+
+  // Something was received since the last ack.
+  bool Pending() const { return messages > 0; }
+
+  /**
+   * @brief Starts over after an ack. Returns its offset, `acked_bytes`.
+   */
+  std::uint64_t Ack() {
+    acked = received;
+    messages = 0;
+    last_ack = Clock::now();
+    return acked;
+  }
+
+ private:
+  const AckOptions &options;
+  std::uint64_t received = 0;
+  std::uint64_t acked = 0;
+  std::uint32_t messages = 0;  // Requests since the last ack
+  Clock::time_point last_ack;
+};
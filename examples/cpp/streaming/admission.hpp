@@ -0,0 +1,96 @@
+#pragma once
+/**
+ * @file admission.hpp
+ * @brief Admission control for long running streaming calls.
+ * @details At most `max_active` calls run at a time. A call that finds them
+ * all busy waits in a queue of at most `max_queued` for up to `queue_timeout`
+ * and is rejected after that; with a zero timeout it is rejected right away.
+ * Overload then turns into fast RESOURCE_EXHAUSTED errors a client can back
+ * off on, instead of every call being accepted and the server growing until
+ * it is OOM-killed. A limit of 0 means unlimited.
+ */
+
+#include <chrono>              // std::chrono
+#include <condition_variable>  // std::condition_variable
+#include <cstdint>             // std::uint64_t
+#include <mutex>               // std::mutex, std::unique_lock
+
+class Admission {
+  typedef std::uint64_t ui64;
+
+ public:
+  Admission(size_t max_active, size_t max_queued, std::chrono::milliseconds queue_timeout)
+      : max_active(max_active), max_queued(max_queued), queue_timeout(queue_timeout) {}
+
+  /**
+   * @brief Admit a call, waiting in the queue if allowed. Every call that
+   * returned true must Leave().
+   */
+  bool Enter() {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (HasRoom()) {
+      return Admit();
+    }
+    if (queue_timeout.count() == 0 || (max_queued > 0 && queued >= max_queued)) {
+      return Shed();
+    }
+    queued++;
+    bool admitted = condition.wait_for(lock, queue_timeout, [this] { return HasRoom(); });
+    queued--;
+    return admitted ? Admit() : Shed();
+  }
+
+  /**
+   * @brief Admit a call only if it can run right now, never waits. For
+   * callers that must not block, e.g. callback API reactions.
+   */
+  bool TryEnter() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return HasRoom() ? Admit() : Shed();
+  }
+
+  void Leave() {
+    std::lock_guard<std::mutex> lock(mutex);
+    active--;
+    condition.notify_one();
+  }
+
+  size_t Active() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return active;
+  }
+
+  ui64 Admitted() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return admitted;
+  }
+
+  ui64 Rejected() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return rejected;
+  }
+
+ private:
+  bool HasRoom() const { return max_active == 0 || active < max_active; }
+
+  bool Admit() {
+    active++;
+    admitted++;
+    return true;
+  }
+
+  bool Shed() {
+    rejected++;
+    return false;
+  }
+
+  const size_t max_active;
+  const size_t max_queued;
+  const std::chrono::milliseconds queue_timeout;
+  std::mutex mutex;
+  std::condition_variable condition;
+  size_t active = 0;
+  size_t queued = 0;
+  ui64 admitted = 0;
+  ui64 rejected = 0;
+};
@@ -0,0 +1,74 @@
+#pragma once
+/**
+ * @file byte_budget.hpp
+ * @brief Counting semaphore over bytes, used to cap the payload a stream or a
+ * whole process keeps in flight.
+ * @details Bytes are acquired before a message is handed to gRPC and released
+ * once the peer has acknowledged it. A request larger than the whole budget
+ * is let through when nothing else is held, so an oversized message slows
+ * things down instead of deadlocking. A limit of 0 means unlimited.
+ */
+
+#include <algorithm>           // std::max
+#include <condition_variable>  // std::condition_variable
+#include <cstddef>             // size_t
+#include <mutex>               // std::mutex, std::unique_lock
+
+class ByteBudget {
+ public:
+  explicit ByteBudget(size_t limit) : limit(limit) {}
+
+  /**
+   * @brief Take `n` bytes if they fit right now.
+   */
+  bool TryAcquire(size_t n) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!Fits(n)) {
+      return false;
+    }
+    Take(n);
+    return true;
+  }
+
+  /**
+   * @brief Take `n` bytes, blocking until enough have been released. Only
+   * call this while holding none of the budget yourself.
+   */
+  void Acquire(size_t n) {
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [this, n] { return Fits(n); });
+    Take(n);
+  }
+
+  void Release(size_t n) {
+    std::lock_guard<std::mutex> lock(mutex);
+    used -= n;
+    condition.notify_all();
+  }
+
+  size_t Used() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return used;
+  }
+
+  size_t Peak() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return peak;
+  }
+
+  size_t Limit() const { return limit; }
+
+ private:
+  bool Fits(size_t n) const { return limit == 0 || used == 0 || used + n <= limit; }
+
+  void Take(size_t n) {
+    used += n;
+    peak = std::max(peak, used);
+  }
+
+  const size_t limit;
+  std::mutex mutex;
+  std::condition_variable condition;
+  size_t used = 0;
+  size_t peak = 0;
+};
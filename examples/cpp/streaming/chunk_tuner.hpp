@@ -0,0 +1,133 @@
+#pragma once
+/**
+ * @file chunk_tuner.hpp
+ * @brief Picks the Request size of streaming uploads from what they measured.
+ * @details The candidates are `min`, 2*min, 4*min, ... up to `max`. Every
+ * finished upload reports its chunk size, bytes, duration and the smallest
+ * time it saw between writing a Request and getting its ack (a round trip
+ * plus the chunk's own transfer). Per size the tuner keeps moving averages of
+ * both and hill-climbs on them: most uploads use the current size, every
+ * `probe_every`-th tries a neighbour (larger and smaller in turn), and the
+ * current size moves to a neighbour that is more than 5% faster, or to the
+ * smaller one when it is within 2% and acks sooner, since memory in flight
+ * and ack latency grow with the chunk. Loopback and a 25G link end up on
+ * different sizes without anyone guessing.
+ */
+
+#include <algorithm>  // std::min, std::max
+#include <cstddef>    // size_t
+#include <iostream>   // std::ostream, std::cout
+#include <mutex>      // std::mutex, std::lock_guard
+#include <vector>     // std::vector
+
+class ChunkTuner {
+ public:
+  /**
+   * @param initial size to start from, rounded to a candidate.
+   */
+  ChunkTuner(size_t min, size_t max, size_t initial, unsigned probe_every = 4) : probe_every(probe_every) {
+    for (size_t size = std::max<size_t>(1, min); size <= std::max(min, max); size *= 2) {
+      sizes.push_back(Size{size});
+    }
+    current = Index(initial);
+  }
+
+  /**
+   * @brief Chunk size for the next upload.
+   */
+  size_t Next() {
+    std::lock_guard<std::mutex> lock(mutex);
+    calls++;
+    if (sizes.size() == 1 || calls % probe_every != 0) {
+      return sizes[current].size;
+    }
+    probe_up = !probe_up;
+    bool up = current == 0 || (probe_up && current + 1 < sizes.size());
+    return sizes[up ? current + 1 : current - 1].size;
+  }
+
+  /**
+   * @brief Account a finished upload that used `chunk`.
+   * @param min_rtt seconds, 0 if no Request was acked.
+   */
+  void Report(size_t chunk, size_t bytes, double seconds, double min_rtt) {
+    if (seconds <= 0) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    Size &size = sizes[Index(chunk)];
+    double mb_per_s = bytes / seconds / (1024 * 1024);
+    size.mb_per_s = size.samples ? (1 - kAlpha) * size.mb_per_s + kAlpha * mb_per_s : mb_per_s;
+    size.rtt = size.samples ? (1 - kAlpha) * size.rtt + kAlpha * min_rtt : min_rtt;
+    size.samples++;
+
+    const Size &here = sizes[current];
+    if (here.samples < kMinSamples) {
+      return;
+    }
+    size_t next = current;
+    if (current + 1 < sizes.size() && Better(sizes[current + 1], here, 1.05)) {
+      next = current + 1;
+    }
+    if (current > 0) {
+      const Size &smaller = sizes[current - 1];
+      if (Better(smaller, here, 1.05) ||
+          (smaller.samples >= kMinSamples && smaller.mb_per_s >= 0.98 * here.mb_per_s && smaller.rtt < here.rtt)) {
+        next = current - 1;
+      }
+    }
+    if (next != current) {
+      std::cout << "chunk tuner: " << here.size / 1024 << " KB (" << here.mb_per_s << " MB/s, rtt "
+                << here.rtt * 1000 << " ms) -> " << sizes[next].size / 1024 << " KB (" << sizes[next].mb_per_s
+                << " MB/s, rtt " << sizes[next].rtt * 1000 << " ms)" << std::endl;
+      current = next;
+    }
+  }
+
+  size_t Current() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return sizes[current].size;
+  }
+
+  void Print(std::ostream &out) {
+    std::lock_guard<std::mutex> lock(mutex);
+    out << "chunk_kb,uploads,mb_per_s,rtt_ms" << std::endl;
+    for (const Size &size : sizes) {
+      if (size.samples) {
+        out << size.size / 1024 << "," << size.samples << "," << size.mb_per_s << "," << size.rtt * 1000 << std::endl;
+      }
+    }
+    out << "chunk tuner settled on " << sizes[current].size / 1024 << " KB" << std::endl;
+  }
+
+ private:
+  struct Size {
+    size_t size;
+    size_t samples = 0;
+    double mb_per_s = 0;
+    double rtt = 0;
+  };
+
+  static constexpr double kAlpha = 0.3;
+  static constexpr size_t kMinSamples = 2;
+
+  static bool Better(const Size &candidate, const Size &here, double factor) {
+    return candidate.samples >= kMinSamples && candidate.mb_per_s > factor * here.mb_per_s;
+  }
+
+  // Candidate closest to `chunk` from below, the smallest for anything less.
+  size_t Index(size_t chunk) const {
+    size_t index = 0;
+    while (index + 1 < sizes.size() && sizes[index + 1].size <= chunk) {
+      index++;
+    }
+    return index;
+  }
+
+  const unsigned probe_every;
+  std::mutex mutex;
+  std::vector<Size> sizes;
+  size_t current = 0;
+  size_t calls = 0;
+  bool probe_up = false;
+};
@@ -5,9 +5,26 @@
 #include <string>
 #include <thread>
 #include <chrono>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+
+#include <grpcpp/generic/generic_stub.h>
 #include <grpcpp/grpcpp.h>
 #include "stdlib.h"
-#include "thread_pool.hpp"
+#include "byte_budget.hpp"
+#include "chunk_tuner.hpp"
+#include "file_io.hpp"
+#include "memory_monitor.hpp"
+#include "reassembly.hpp"
+#include "profile/grpc/thread_pool.hpp"
+#include "profile/histogram.h"
+#include "zero_copy.hpp"
 
 #ifdef BAZEL_BUILD
 #include "examples/protos/data.grpc.pb.h"
@@ -15,61 +32,416 @@
 #include "data.grpc.pb.h"
 #endif
 
+ABSL_FLAG(std::string, target, "localhost:50051", "Server address");
+ABSL_FLAG(bool, zero_copy, false, "send the payload as slices of the caller's buffer, never copying it");
+ABSL_FLAG(uint32_t, rounds, 300, "rounds of uploads");
+ABSL_FLAG(uint32_t, tasks, 20, "uploads per round, spread over 5 threads");
+ABSL_FLAG(bool, work_stealing, true, "spread uploads over the 5 threads by work stealing instead of pinning upload i to thread i%5");
+ABSL_FLAG(bool, round_barrier, false, "start a round once the whole previous round finished, instead of running tasks "
+          "independent chains of rounds uploads");
+ABSL_FLAG(uint32_t, size_mb, 100, "size of one upload in MB");
+ABSL_FLAG(std::string, source_file, "", "upload this file, mapped, instead of --size_mb from the heap (not with --bounded)");
+ABSL_FLAG(bool, bounded, false, "generate the payload chunk by chunk and bound the bytes in flight");
+ABSL_FLAG(uint32_t, chunk_kb, 3072, "size of one Request, the starting point with --adaptive_chunk");
+ABSL_FLAG(bool, adaptive_chunk, false, "tune the Request size between min_chunk_kb and max_chunk_kb from measured throughput and rtt");
+ABSL_FLAG(uint32_t, min_chunk_kb, 64, "smallest Request size tried by --adaptive_chunk and --sweep");
+ABSL_FLAG(uint32_t, max_chunk_kb, 16384, "largest Request size tried by --adaptive_chunk and --sweep");
+ABSL_FLAG(uint32_t, stripes, 1, "send every upload as this many byte ranges over concurrent calls, reassembled by the server");
+ABSL_FLAG(bool, stripe_channels, false, "stripes: one channel (TCP connection) per stripe instead of sharing one");
+ABSL_FLAG(bool, sweep, false, "run rounds x tasks uploads once per Request size (powers of two from min_chunk_kb to "
+                              "max_chunk_kb) and print MB/s, peak rss and rtt for each");
+ABSL_FLAG(uint32_t, stream_budget_mb, 12, "bounded: bytes written but not yet acked, per stream (0: unlimited)");
+ABSL_FLAG(uint32_t, process_budget_mb, 48, "bounded: bytes written but not yet acked, all streams (0: unlimited)");
+ABSL_FLAG(bool, buffer_hint, true, "bounded: let gRPC coalesce a write with the next one while the budget has room");
+
+using grpc::ByteBuffer;
 using grpc::Channel;
 using grpc::ClientContext;
+using grpc::CompletionQueue;
 using grpc::Status;
 using grpc::ClientReader;
 using grpc::ClientReaderWriter;
 using grpc::ClientWriter;
+using grpc::WriteOptions;
 using data::GRPCDemo;
 using data::Request;
 using data::Response;
+using Clock = std::chrono::steady_clock;
 
 uint64_t GetTimeStamp() {  // 直接调用此函数就可以返回时间戳了
   return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch())
       .count();
 }
+
+// What one upload measured, for --adaptive_chunk and --sweep.
+struct StreamStats {
+  size_t bytes = 0;  // the upload's size, 0 if it failed
+  size_t acked = 0;  // payload bytes the server acked, also of a failed upload
+  double seconds = 0;
+  double min_rtt = 0;  // smallest time from writing a Request to its ack, 0 if none was acked
+};
+
+// Acked offset and write-to-ack times of one stream. An ack carries the
+// payload bytes the server received so far and may cover several Requests
+// (see ack_policy.hpp); its rtt is taken from the last Request it covers,
+// the one that waited least for the server to ack.
+class AckTimer {
+ public:
+  // A Request ending at payload offset `end` was written.
+  void Sent(size_t end) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sent_.emplace_back(end, Clock::now());
+  }
+
+  void Acked(size_t offset) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    acked_ = std::max(acked_, offset);
+    Clock::time_point last{};
+    while (!sent_.empty() && sent_.front().first <= offset) {
+      last = sent_.front().second;
+      sent_.pop_front();
+    }
+    if (last == Clock::time_point{}) {
+      return;
+    }
+    double rtt = std::chrono::duration<double>(Clock::now() - last).count();
+    min_rtt_ = min_rtt_ == 0 ? rtt : std::min(min_rtt_, rtt);
+  }
+
+  // Payload bytes the server acked.
+  size_t Offset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return acked_;
+  }
+
+  // Fills `stats` for a finished upload of `bytes` started at `start`, 0
+  // bytes if it failed.
+  void Finish(Clock::time_point start, size_t bytes, StreamStats* stats) {
+    if (stats == nullptr) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats->bytes = bytes;
+    stats->acked = acked_;
+    stats->seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    stats->min_rtt = min_rtt_;
+  }
+
+  double MinRtt() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return min_rtt_;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::deque<std::pair<size_t, Clock::time_point>> sent_;
+  size_t acked_ = 0;
+  double min_rtt_ = 0;
+};
+
+struct BoundedOptions {
+  size_t chunk;
+  size_t stream_budget;
+  ByteBudget* process_budget;
+  bool buffer_hint;
+};
+
 class GRPCDemoClient {
  public:
-  GRPCDemoClient(std::shared_ptr<Channel> channel)
-      : stub_(GRPCDemo::NewStub(channel)) {}
+  // `stripe_channels`, if any, carry the stripes of StreamingMethodStriped,
+  // one per stripe; without them all stripes share `channel`.
+  GRPCDemoClient(std::shared_ptr<Channel> channel, std::vector<std::shared_ptr<Channel>> stripe_channels = {})
+      : stub_(GRPCDemo::NewStub(channel)), generic_stub_(channel) {
+    for (auto& stripe_channel : stripe_channels) {
+      stripe_stubs_.push_back(GRPCDemo::NewStub(stripe_channel));
+    }
+    std::random_device random;
+    transfer_prefix_ = std::to_string(random()) + std::to_string(random()) + "-";
+  }
 
 
-  std::string StreamingMethod(int length,char * data) {
+  // `source`, if given, is the mapped file `data` points into.
+  std::string StreamingMethod(size_t length, const char* data, size_t chunk, StreamStats* stats = nullptr,
+                              const file_io::MappedFile* source = nullptr) {
     ClientContext context;
+    Clock::time_point start = Clock::now();
+    AckTimer acks;
+    Status status = SendRange(stub_.get(), &context, data, length, chunk, &acks, source);
+    if (!status.ok()) {
+      std::cout << "stream rpc failed, " << acks.Offset() << " of " << length << " bytes acked." << std::endl;
+    }
+    acks.Finish(start, status.ok() ? length : 0, stats);
+    return "stream end\n";
+  }
 
-    std::shared_ptr<ClientReaderWriter<Request, Response> > stream(
-        stub_->StreamingMethod(&context));
-    std::thread writer([&,stream]() {
-      std::vector<Request> requests;
-      int left=0;
-      int maxlength=1024*1024*3;
-      int right=length<maxlength?length:maxlength;
-      int id=0;
-      while(left<length){
-        std::string string_data (data+left, data+right);
-        Request req;
-        req.set_data(string_data);
-        stream->Write(req);
-        left=right;
-        right=length<left+maxlength?length:left+maxlength;
-        id++;
+  // StreamingMethod over `stripes` calls at once, each sending one contiguous
+  // range of `data`. A single stream is held back by its HTTP/2 flow control
+  // window, which on a high bandwidth-delay path covers a fraction of the
+  // link; several windows in flight cover more of it. The calls carry the
+  // offset metadata of reassembly.hpp and the server puts the ranges back
+  // together in one buffer. A transfer whose stripes did not all succeed is
+  // reported as failed and left to expire on the server.
+  std::string StreamingMethodStriped(size_t length, const char* data, size_t chunk, int stripes,
+                                     StreamStats* stats = nullptr, const file_io::MappedFile* source = nullptr) {
+    std::string transfer_id = transfer_prefix_ + std::to_string(next_transfer_++);
+    Clock::time_point start = Clock::now();
+    std::vector<AckTimer> acks(stripes);
+    std::vector<Status> statuses(stripes);
+    std::vector<std::thread> senders;
+    size_t stripe_length = (length + stripes - 1) / stripes;
+    for (int i = 0; i < stripes; ++i) {
+      size_t offset = std::min(length, i * stripe_length);
+      size_t n = std::min(stripe_length, length - offset);
+      GRPCDemo::Stub* stub = stripe_stubs_.empty() ? stub_.get() : stripe_stubs_[i % stripe_stubs_.size()].get();
+      senders.emplace_back([&, i, offset, n, stub] {
+        ClientContext context;
+        context.AddMetadata(reassembly::kTransferId, transfer_id);
+        context.AddMetadata(reassembly::kTotalSize, std::to_string(length));
+        context.AddMetadata(reassembly::kOffset, std::to_string(offset));
+        statuses[i] = SendRange(stub, &context, data + offset, n, chunk, &acks[i], source);
+      });
+    }
+    for (auto& sender : senders) {
+      sender.join();
+    }
+    if (stats != nullptr) {
+      for (AckTimer& timer : acks) {
+        stats->acked += timer.Offset();
       }
-      stream->WritesDone();
-      //std::cout << "===streaming client send:"<<(double)length/1024/1024<<" MB" << std::endl;
-    });
+    }
+    for (int i = 0; i < stripes; ++i) {
+      if (!statuses[i].ok()) {
+        std::cout << "stream rpc failed, stripe " << i << " had " << acks[i].Offset() << " bytes acked." << std::endl;
+        return "stream end\n";
+      }
+    }
+    if (stats != nullptr) {
+      stats->bytes = length;
+      stats->seconds = std::chrono::duration<double>(Clock::now() - start).count();
+      for (AckTimer& timer : acks) {
+        double rtt = timer.MinRtt();
+        if (rtt > 0 && (stats->min_rtt == 0 || rtt < stats->min_rtt)) {
+          stats->min_rtt = rtt;
+        }
+      }
+    }
+    return "stream end\n";
+  }
 
-    Response server_reply;
-    double recv_length=0;
-    while (stream->Read(&server_reply)) {
-      recv_length+=server_reply.data().length();
+  // Zero copy variant of StreamingMethod, same messages on the wire. The
+  // call goes through the generic stub: every `chunk` window of `data` is sent as
+  // a Request whose payload slice points into `data` (see zero_copy.hpp), so
+  // the only copy left is the kernel's, into the socket. Like the synchronous
+  // API it is driven from this thread on a private CompletionQueue, with one
+  // write and one read (of the acks) in flight.
+  std::string StreamingMethodZeroCopy(size_t length, const char* data, size_t chunk, StreamStats* stats = nullptr,
+                                      const file_io::MappedFile* source = nullptr) {
+    enum Tag { kStart = 1, kWrite, kRead, kWritesDone, kFinish };
+    zero_copy::PinnedBuffer pin;
+    Status status;
+    Clock::time_point start = Clock::now();
+    AckTimer acks;
+    {
+      ClientContext context;
+      CompletionQueue cq;
+      std::unique_ptr<grpc::GenericClientAsyncReaderWriter> call =
+          generic_stub_.PrepareCall(&context, zero_copy::kStreamingMethod, &cq);
+      call->StartCall(reinterpret_cast<void*>(kStart));
+
+      size_t left = 0;
+      ByteBuffer req, ack;
+      bool finishing = false;
+      void* tag;
+      bool ok;
+      while (cq.Next(&tag, &ok)) {
+        switch (static_cast<Tag>(reinterpret_cast<intptr_t>(tag))) {
+          case kStart:
+            if (!ok) {
+              finishing = true;
+              call->Finish(&status, reinterpret_cast<void*>(kFinish));
+              break;
+            }
+            call->Read(&ack, reinterpret_cast<void*>(kRead));
+            [[fallthrough]];  // issue the first write
+          case kWrite:
+            // Our own reference to the slices just written, gRPC may still
+            // hold one.
+            req.Clear();
+            if (source != nullptr && left > 0) {
+              size_t last = (left - 1) / chunk * chunk;
+              source->Sent(data + last, left - last);
+            }
+            if (!ok || finishing) {
+              break;  // the stream broke, Read fails too and finishes the call
+            }
+            if (left < length) {
+              size_t n = std::min(chunk, length - left);
+              req = zero_copy::WrapRequest(data + left, n, &pin);
+              left += n;
+              acks.Sent(left);
+              call->Write(req, reinterpret_cast<void*>(kWrite));
+            } else {
+              call->WritesDone(reinterpret_cast<void*>(kWritesDone));
+            }
+            break;
+          case kRead:
+            if (ok) {
+              std::vector<grpc::Slice> slices;
+              uint64_t acked = 0;
+              if (ack.Dump(&slices).ok() && zero_copy::AckedBytes(slices, &acked)) {
+                acks.Acked(acked);
+              }
+              call->Read(&ack, reinterpret_cast<void*>(kRead));
+            } else {
+              finishing = true;
+              call->Finish(&status, reinterpret_cast<void*>(kFinish));
+            }
+            break;
+          case kWritesDone:
+            break;
+          case kFinish:
+            cq.Shutdown();
+            break;
+        }
+      }
     }
-    writer.join();
-    //std::cout << "===streaming client recv::"<<recv_length/1024/1024<<" MB" << std::endl;
-    Status status = stream->Finish();
+    // gRPC lets go of the last slices only once the call is destroyed.
+    pin.Wait();
     if (!status.ok()) {
-      std::cout << "stream rpc failed." << std::endl;
+      std::cout << "stream rpc failed, " << acks.Offset() << " of " << length << " bytes acked." << std::endl;
     }
+    acks.Finish(start, status.ok() ? length : 0, stats);
+    return "stream end\n";
+  }
+
+
+  // StreamingMethod with bounded memory, whatever `length` is. The payload is
+  // generated chunk by chunk into one reused Request instead of sitting in a
+  // buffer of its own, a write is only issued once the previous one completed,
+  // and the bytes written but not yet acked by the server stay within the
+  // stream's budget and the process wide one. Past that the writer waits for
+  // acks, i.e. for the server to catch up, instead of piling messages up in
+  // gRPC's buffers. A server coalescing its acks may not ack before more
+  // arrives, so a writer that has to wait asks for an ack with an empty
+  // `ack_now` Request.
+  std::string StreamingMethodBounded(size_t length, const BoundedOptions& options, StreamStats* stats = nullptr) {
+    enum Tag { kStart = 1, kWrite, kRead, kWritesDone, kFinish };
+    Clock::time_point start = Clock::now();
+    AckTimer acks;
+    ClientContext context;
+    CompletionQueue cq;
+    std::unique_ptr<grpc::ClientAsyncReaderWriter<Request, Response>> stream =
+        stub_->PrepareAsyncStreamingMethod(&context, &cq);
+    stream->StartCall(reinterpret_cast<void*>(kStart));
+
+    Request req;
+    req.mutable_data()->assign(std::min(options.chunk, length), 'a');
+    Request ask;
+    ask.set_ack_now(true);
+    Response ack;
+    Status status;
+    size_t sent = 0, acked = 0;
+    bool started = false, writing = false, writes_done = false, finishing = false;
+    bool asked = false;  // an ack was asked for and has not come yet
+
+    auto in_flight = [&] { return sent - acked; };
+    // Out of budget until acks come.
+    auto ask_ack = [&] {
+      if (asked) {
+        return;
+      }
+      asked = true;
+      writing = true;
+      stream->Write(ask, reinterpret_cast<void*>(kWrite));
+    };
+    // Writes the next chunk if nothing is being written and the budgets allow.
+    auto next_write = [&] {
+      if (!started || writing || writes_done || finishing) {
+        return;
+      }
+      size_t n = std::min<size_t>(options.chunk, length - sent);
+      if (options.stream_budget > 0 && in_flight() > 0 && in_flight() + n > options.stream_budget) {
+        ask_ack();
+        return;
+      }
+      if (!options.process_budget->TryAcquire(n)) {
+        if (in_flight() > 0) {
+          ask_ack();  // our own acks will free budget
+          return;
+        }
+        // Holding nothing, so waiting on the other streams cannot deadlock.
+        options.process_budget->Acquire(n);
+      }
+      req.mutable_data()->resize(n);
+      sent += n;
+      acks.Sent(sent);
+      writing = true;
+      WriteOptions write_options;
+      bool last = sent == length;
+      if (options.buffer_hint && !last &&
+          (options.stream_budget == 0 || in_flight() + options.chunk <= options.stream_budget)) {
+        // The next write follows right away, no need to flush this one alone.
+        write_options.set_buffer_hint();
+      }
+      if (last) {
+        writes_done = true;
+        stream->WriteLast(req, write_options, reinterpret_cast<void*>(kWrite));
+      } else {
+        stream->Write(req, write_options, reinterpret_cast<void*>(kWrite));
+      }
+    };
+
+    void* tag;
+    bool ok;
+    while (cq.Next(&tag, &ok)) {
+      switch (static_cast<Tag>(reinterpret_cast<intptr_t>(tag))) {
+        case kStart:
+          if (!ok) {
+            finishing = true;
+            stream->Finish(&status, reinterpret_cast<void*>(kFinish));
+            break;
+          }
+          started = true;
+          stream->Read(&ack, reinterpret_cast<void*>(kRead));
+          if (length == 0) {
+            writes_done = true;
+            stream->WritesDone(reinterpret_cast<void*>(kWritesDone));
+          }
+          next_write();
+          break;
+        case kWrite:
+          writing = false;
+          if (ok) {
+            next_write();
+          }
+          break;
+        case kRead:
+          if (!ok) {
+            finishing = true;
+            stream->Finish(&status, reinterpret_cast<void*>(kFinish));
+            break;
+          }
+          if (ack.acked_bytes() > acked && ack.acked_bytes() <= sent) {
+            options.process_budget->Release(ack.acked_bytes() - acked);
+            acked = ack.acked_bytes();
+            acks.Acked(acked);
+          }
+          asked = false;
+          stream->Read(&ack, reinterpret_cast<void*>(kRead));
+          next_write();
+          break;
+        case kWritesDone:
+          break;
+        case kFinish:
+          cq.Shutdown();
+          break;
+      }
+    }
+    options.process_budget->Release(in_flight());
+    if (!status.ok()) {
+      std::cout << "stream rpc failed, " << acked << " of " << length << " bytes acked." << std::endl;
+    }
+    acks.Finish(start, status.ok() ? length : 0, stats);
     return "stream end\n";
   }
 
@@ -92,52 +464,215 @@ class GRPCDemoClient {
   }
 
  private:
+  // One StreamingMethod call sending `length` bytes of `data` as Requests of
+  // `chunk` bytes, from a writer thread while this one reads the acks.
+  Status SendRange(GRPCDemo::Stub* stub, ClientContext* context, const char* data, size_t length, size_t chunk,
+                   AckTimer* acks, const file_io::MappedFile* source) {
+    std::shared_ptr<ClientReaderWriter<Request, Response> > stream(
+        stub->StreamingMethod(context));
+    std::thread writer([&,stream]() {
+      std::vector<Request> requests;
+      size_t left=0;
+      size_t maxlength=chunk;
+      size_t right=length<maxlength?length:maxlength;
+      int id=0;
+      while(left<length){
+        std::string string_data (data+left, data+right);
+        if (source != nullptr) {
+          source->Sent(data + left, right - left);
+        }
+        Request req;
+        req.set_data(string_data);
+        acks->Sent(right);
+        stream->Write(req);
+        left=right;
+        right=length<left+maxlength?length:left+maxlength;
+        id++;
+      }
+      stream->WritesDone();
+      //std::cout << "===streaming client send:"<<(double)length/1024/1024<<" MB" << std::endl;
+    });
+
+    Response server_reply;
+    double recv_length=0;
+    while (stream->Read(&server_reply)) {
+      acks->Acked(server_reply.acked_bytes());
+      recv_length+=server_reply.data().length();
+    }
+    writer.join();
+    //std::cout << "===streaming client recv::"<<recv_length/1024/1024<<" MB" << std::endl;
+    return stream->Finish();
+  }
+
   std::unique_ptr<GRPCDemo::Stub> stub_;
+  grpc::GenericStub generic_stub_;
+  std::vector<std::unique_ptr<GRPCDemo::Stub>> stripe_stubs_;
+  std::string transfer_prefix_;
+  std::atomic<uint64_t> next_transfer_{0};
 };
+
+// Runs `upload` rounds x tasks times on `pool`. With `barrier` round after
+// round, each waiting for all of the previous one. Otherwise as `tasks`
+// chains of `rounds` uploads in one task_group: an upload starts as soon as
+// the previous one of its chain finished, so the pool does not idle at round
+// boundaries while the slowest upload of a round finishes.
+template <typename F>
+void RunRounds(thread_pool& pool, int rounds, int tasks, bool barrier, const F& upload) {
+  if (barrier) {
+    std::vector<F> batch(tasks, upload);
+    for (int index = 0; index < rounds; ++index) {
+      task_latch round;
+      pool.push_batch(batch, &round);
+      round.wait();
+    }
+    return;
+  }
+  if (rounds <= 0) {
+    return;
+  }
+  task_group uploads(pool);
+  std::function<void(int)> chain = [&](int round) {
+    upload();
+    if (round + 1 < rounds) {
+      uploads.run([&chain, round] { chain(round + 1); });
+    }
+  };
+  for (int i = 0; i < tasks; ++i) {
+    uploads.run([&chain] { chain(0); });
+  }
+  uploads.wait();
+}
 int main(int argc, char** argv) {
   // Instantiate the client. It requires a channel, out of which the actual RPCs
   // are created. This channel models a connection to an endpoint specified by
-  // the argument "--target=" which is the only expected argument.
+  // the argument "--target=".
   // We indicate that the channel isn't authenticated (use of
   // InsecureChannelCredentials()).
-  std::string target_str;
-  std::string arg_str("--target");
-  if (argc > 1) {
-    std::string arg_val = argv[1];
-    size_t start_pos = arg_val.find(arg_str);
-    if (start_pos != std::string::npos) {
-      start_pos += arg_str.size();
-      if (arg_val[start_pos] == '=') {
-        target_str = arg_val.substr(start_pos + 1);
-      } else {
-        std::cout << "The only correct argument syntax is --target="
-                  << std::endl;
-        return 0;
-      }
-    } else {
-      std::cout << "The only acceptable argument is --target=" << std::endl;
-      return 0;
+  absl::ParseCommandLine(argc, argv);
+  std::string target_str = absl::GetFlag(FLAGS_target);
+  bool zero_copy = absl::GetFlag(FLAGS_zero_copy);
+  int rounds = absl::GetFlag(FLAGS_rounds);
+  int tasks = absl::GetFlag(FLAGS_tasks);
+  size_t length = size_t(absl::GetFlag(FLAGS_size_mb)) * 1024 * 1024;
+  bool bounded = absl::GetFlag(FLAGS_bounded);
+  std::unique_ptr<file_io::MappedFile> source;
+  if (!absl::GetFlag(FLAGS_source_file).empty()) {
+    source.reset(new file_io::MappedFile(absl::GetFlag(FLAGS_source_file)));
+    if (!source->Ok()) {
+      std::cout << "cannot map " << source->Error() << std::endl;
+      return 1;
+    }
+    length = source->Size();
+    if (bounded) {
+      std::cout << "--bounded generates its payload, it does not read --source_file" << std::endl;
+      return 1;
     }
-  } else {
-    target_str = "localhost:50051";
   }
-  thread_pool pool(5);
+  ByteBudget process_budget(size_t(absl::GetFlag(FLAGS_process_budget_mb)) * 1024 * 1024);
+  BoundedOptions options{std::max<size_t>(1, absl::GetFlag(FLAGS_chunk_kb)) * 1024,
+                         size_t(absl::GetFlag(FLAGS_stream_budget_mb)) * 1024 * 1024, &process_budget,
+                         absl::GetFlag(FLAGS_buffer_hint)};
+  size_t min_chunk = std::max<size_t>(1, absl::GetFlag(FLAGS_min_chunk_kb)) * 1024;
+  size_t max_chunk = std::max<size_t>(1, absl::GetFlag(FLAGS_max_chunk_kb)) * 1024;
+  bool work_stealing = absl::GetFlag(FLAGS_work_stealing);
+  bool round_barrier = absl::GetFlag(FLAGS_round_barrier);
+  thread_pool pool(5, work_stealing ? thread_pool::schedule::work_stealing : thread_pool::schedule::pinned);
   grpc::ChannelArguments ch_args;  // mydebug grpc max message;
   ch_args.SetMaxReceiveMessageSize(-1);
   ch_args.SetMaxSendMessageSize(-1);
   auto  channel = grpc::CreateCustomChannel(target_str, grpc::InsecureChannelCredentials(), ch_args);
-  GRPCDemoClient GRPCDemo(channel);
+  int stripes = std::max<uint32_t>(1, absl::GetFlag(FLAGS_stripes));
+  std::vector<std::shared_ptr<Channel>> stripe_channels;
+  if (stripes > 1 && absl::GetFlag(FLAGS_stripe_channels)) {
+    // Channels with the same target and args share their subchannel, and so
+    // the connection, unless each keeps a pool of its own.
+    grpc::ChannelArguments stripe_args = ch_args;
+    stripe_args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+    for (int i = 0; i < stripes; ++i) {
+      stripe_channels.push_back(grpc::CreateCustomChannel(target_str, grpc::InsecureChannelCredentials(), stripe_args));
+    }
+  }
+  GRPCDemoClient GRPCDemo(channel, stripe_channels);
+  // One upload in the selected mode with Requests of `chunk` bytes.
+  // With --source_file every upload reads the one shared mapping instead.
+  auto upload = [length, zero_copy, bounded, stripes, &source, &options, &GRPCDemo](size_t chunk,
+                                                                                  StreamStats* stats) {
+    const file_io::MappedFile* file = source.get();
+    if (file != nullptr) {
+      if (stripes > 1) {
+        GRPCDemo.StreamingMethodStriped(length, file->Data(), chunk, stripes, stats, file);
+      } else if (zero_copy) {
+        GRPCDemo.StreamingMethodZeroCopy(length, file->Data(), chunk, stats, file);
+      } else {
+        GRPCDemo.StreamingMethod(length, file->Data(), chunk, stats, file);
+      }
+      return;
+    }
+    if (stripes > 1) {
+      char* data = new char[length];
+      GRPCDemo.StreamingMethodStriped(length, data, chunk, stripes, stats);
+      delete[] data;
+      return;
+    }
+    if (bounded) {
+      BoundedOptions chunked = options;
+      chunked.chunk = chunk;
+      GRPCDemo.StreamingMethodBounded(length, chunked, stats);
+      return;
+    }
+    char * data =new char[length];
+    std::string reply = zero_copy ? GRPCDemo.StreamingMethodZeroCopy(length, data, chunk, stats)
+                                  : GRPCDemo.StreamingMethod(length, data, chunk, stats);
+    delete []data;
+  };
+
+  if (absl::GetFlag(FLAGS_sweep)) {
+    std::cout << "chunk_kb,mb_per_s,peak_rss_mb,rtt_p50_ms,failed" << std::endl;
+    for (size_t chunk = min_chunk; chunk <= max_chunk; chunk *= 2) {
+      std::mutex mutex;
+      histogram rtt;  // per upload, its smallest write-to-ack time
+      size_t failed = 0;
+      size_t acked = 0;  // only what the server acked counts towards MB/s
+      MemoryMonitor::ResetPeakRss();
+      Clock::time_point start = Clock::now();
+      auto measured = [chunk, &upload, &mutex, &rtt, &failed, &acked] {
+        StreamStats stats;
+        upload(chunk, &stats);
+        std::lock_guard<std::mutex> lock(mutex);
+        acked += stats.acked;
+        if (stats.bytes == 0) {
+          failed++;
+        } else {
+          rtt.Record(stats.min_rtt * 1e9);
+        }
+      };
+      RunRounds(pool, rounds, tasks, round_barrier, measured);
+      double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+      double mb = double(acked) / (1024 * 1024);
+      std::cout << chunk / 1024 << "," << mb / seconds << "," << MemoryMonitor::PeakRssKb() / 1024 << ","
+                << rtt.Percentile(50) / 1e6 << "," << failed << std::endl;
+    }
+    return 0;
+  }
+
+  bool adaptive = absl::GetFlag(FLAGS_adaptive_chunk);
+  ChunkTuner tuner(min_chunk, max_chunk, options.chunk);
+  auto one_upload = [adaptive,&tuner,&options,&upload]{
+    if (!adaptive) {
+      upload(options.chunk, nullptr);
+      return;
+    }
+    size_t chunk = tuner.Next();
+    StreamStats stats;
+    upload(chunk, &stats);
+    if (stats.bytes > 0) {
+      tuner.Report(chunk, stats.bytes, stats.seconds, stats.min_rtt);
+    }
+  };
   //while(true){
-  for(auto index=0;index<300;++index){
-    for (int i=0;i<20;++i){
-        pool.push_task([target_str,&GRPCDemo]{
-          int length=100*1024*1024;//100MB
-          char * data =new char[length];
-          std::string reply = GRPCDemo.StreamingMethod(length,data);
-          delete []data;
-      },i%5);
-  }
-  pool.wait_for_tasks();
+  RunRounds(pool, rounds, tasks, round_barrier, one_upload);
+  if (adaptive) {
+    tuner.Print(std::cout);
   }
   return 0;
 }
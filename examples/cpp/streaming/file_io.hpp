@@ -0,0 +1,305 @@
+#pragma once
+/**
+ * @file file_io.hpp
+ * @brief File sources and sinks for streaming transfers, so a multi-GB
+ * payload never has to sit on the heap.
+ * @details
+ * - MappedFile: the client's source, mapped read only and shared by every
+ *   upload of it. Pages come from the page cache on demand; Sent() reads the
+ *   next window ahead and unmaps what went out, which the page cache keeps for
+ *   the other uploads of the same file.
+ * - MappedSink: the server writes a stream into a file through a shared
+ *   mapping, one window at a time: the file grows by a window, the window is
+ *   mapped, filled, written back and dropped from the page cache, so a
+ *   receiving stream holds at most two windows of page cache.
+ * - DirectSink: O_DIRECT writes from an aligned buffer, bypassing the page
+ *   cache altogether. Falls back to buffered writes where the file system
+ *   has no O_DIRECT (tmpfs).
+ */
+
+#include <fcntl.h>     // open, posix_fadvise, sync_file_range
+#include <sys/mman.h>  // mmap, madvise
+#include <sys/stat.h>  // fstat
+#include <unistd.h>    // ftruncate, pwrite, close
+
+#include <algorithm>  // std::min
+#include <cerrno>     // errno
+#include <cstdlib>    // posix_memalign, free
+#include <cstring>    // std::memcpy, std::strerror
+#include <memory>     // std::unique_ptr
+#include <string>     // std::string
+
+namespace file_io {
+
+inline size_t PageSize() {
+  static const size_t page = size_t(sysconf(_SC_PAGESIZE));
+  return page;
+}
+
+class MappedFile {
+ public:
+  /**
+   * @param readahead bytes Sent() asks the kernel to read ahead.
+   */
+  explicit MappedFile(const std::string &path, size_t readahead = 16 << 20) : readahead(readahead) {
+    fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      error = path + ": " + std::strerror(errno);
+      return;
+    }
+    size = size_t(st.st_size);
+    if (size == 0) {
+      return;
+    }
+    void *map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+      error = path + ": " + std::strerror(errno);
+      return;
+    }
+    data = static_cast<const char *>(map);
+    madvise(const_cast<char *>(data), size, MADV_SEQUENTIAL);
+    madvise(const_cast<char *>(data), std::min(size, readahead), MADV_WILLNEED);
+  }
+
+  ~MappedFile() {
+    if (data != nullptr) {
+      munmap(const_cast<char *>(data), size);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  bool Ok() const { return error.empty(); }
+  const std::string &Error() const { return error; }
+  const char *Data() const { return data; }
+  size_t Size() const { return size; }
+
+  /**
+   * @brief [begin, begin + n) of the mapping went out: read the window after
+   * it ahead and stop mapping it in this process.
+   */
+  void Sent(const char *begin, size_t n) const {
+    size_t offset = begin - data;
+    size_t end = std::min(size, offset + n);
+    if (end < size) {
+      size_t ahead = end / PageSize() * PageSize();
+      madvise(const_cast<char *>(data) + ahead, std::min(readahead, size - ahead), MADV_WILLNEED);
+    }
+    // Whole pages only, the neighbouring chunks may still be on their way.
+    size_t first = (offset + PageSize() - 1) / PageSize() * PageSize();
+    size_t last = end == size ? size : end / PageSize() * PageSize();
+    if (last > first) {
+      madvise(const_cast<char *>(data) + first, last - first, MADV_DONTNEED);
+    }
+  }
+
+ private:
+  const size_t readahead;
+  int fd = -1;
+  const char *data = nullptr;
+  size_t size = 0;
+  std::string error;
+};
+
+class FileSink {
+ public:
+  virtual ~FileSink() = default;
+  virtual bool Write(const void *data, size_t n) = 0;
+  // Trims the file to what was written and closes it.
+  virtual bool Close() = 0;
+  size_t Written() const { return written; }
+
+ protected:
+  size_t written = 0;
+};
+
+class MappedSink final : public FileSink {
+ public:
+  MappedSink(int fd, size_t window) : fd(fd), window(std::max(PageSize(), window / PageSize() * PageSize())) {}
+
+  ~MappedSink() override { Close(); }
+
+  bool Write(const void *data, size_t n) override {
+    const char *p = static_cast<const char *>(data);
+    while (n > 0) {
+      if (map == nullptr && !MapNext()) {
+        return false;
+      }
+      size_t room = map_end - written;
+      size_t take = std::min(room, n);
+      std::memcpy(map + (written - map_begin), p, take);
+      written += take;
+      p += take;
+      n -= take;
+      if (written == map_end) {
+        Flush();
+      }
+    }
+    return true;
+  }
+
+  bool Close() override {
+    if (fd < 0) {
+      return true;
+    }
+    Flush();
+    if (written > map_begin) {
+      Settle(map_begin);  // the last window
+    }
+    bool ok = ftruncate(fd, written) == 0;
+    close(fd);
+    fd = -1;
+    return ok;
+  }
+
+ private:
+  bool MapNext() {
+    map_begin = written;
+    map_end = written + window;
+    if (ftruncate(fd, map_end) != 0) {
+      return false;
+    }
+    void *window_map = mmap(nullptr, window, PROT_READ | PROT_WRITE, MAP_SHARED, fd, map_begin);
+    if (window_map == MAP_FAILED) {
+      return false;
+    }
+    map = static_cast<char *>(window_map);
+    madvise(map, window, MADV_SEQUENTIAL);
+    return true;
+  }
+
+  // Starts writeback of the window just filled and waits for the one before,
+  // which is then dropped from the page cache: a stream passes through the
+  // cache with at most two windows in it instead of filling it.
+  void Flush() {
+    if (map == nullptr) {
+      return;
+    }
+    munmap(map, window);
+    map = nullptr;
+    sync_file_range(fd, map_begin, window, SYNC_FILE_RANGE_WRITE);
+    if (map_begin > 0) {
+      Settle(map_begin - window);
+    }
+  }
+
+  void Settle(size_t begin) {
+    sync_file_range(fd, begin, window,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(fd, begin, window, POSIX_FADV_DONTNEED);
+  }
+
+  int fd;
+  const size_t window;
+  char *map = nullptr;
+  size_t map_begin = 0;
+  size_t map_end = 0;
+};
+
+class DirectSink final : public FileSink {
+ public:
+  // `direct`: the fd was opened with O_DIRECT.
+  DirectSink(int fd, size_t buffer_size, bool direct)
+      : fd(fd), direct(direct), capacity(std::max(PageSize(), buffer_size / PageSize() * PageSize())) {
+    void *memory = nullptr;
+    if (posix_memalign(&memory, PageSize(), capacity) == 0) {
+      buffer.reset(static_cast<char *>(memory));
+    }
+  }
+
+  ~DirectSink() override { Close(); }
+
+  bool Write(const void *data, size_t n) override {
+    const char *p = static_cast<const char *>(data);
+    while (n > 0) {
+      if (!buffer) {
+        return false;
+      }
+      size_t take = std::min(capacity - used, n);
+      std::memcpy(buffer.get() + used, p, take);
+      used += take;
+      p += take;
+      n -= take;
+      if (used == capacity && !Drain(capacity)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool Close() override {
+    if (fd < 0) {
+      return true;
+    }
+    // O_DIRECT writes whole blocks: pad the tail, then cut the file back.
+    size_t tail = used;
+    size_t padded = direct ? (used + PageSize() - 1) / PageSize() * PageSize() : used;
+    bool ok = Drain(padded);
+    if (ok) {
+      // Drain() only counts what it wrote, the padding with it.
+      written -= padded - tail;
+      ok = ftruncate(fd, written) == 0;
+    }
+    close(fd);
+    fd = -1;
+    return ok;
+  }
+
+ private:
+  struct Free {
+    void operator()(char *p) const { free(p); }
+  };
+
+  bool Drain(size_t n) {
+    size_t done = 0;
+    while (done < n) {
+      ssize_t w = pwrite(fd, buffer.get() + done, n - done, file_offset + done);
+      if (w <= 0) {
+        return false;
+      }
+      done += size_t(w);
+    }
+    file_offset += n;
+    written += n;
+    used = 0;
+    return true;
+  }
+
+  int fd;
+  const bool direct;
+  const size_t capacity;
+  std::unique_ptr<char, Free> buffer;
+  size_t used = 0;
+  size_t file_offset = 0;
+};
+
+/**
+ * @brief Creates `path` as a sink: "mmap" or "direct". Null with `error` set
+ * if the file cannot be created.
+ */
+inline std::unique_ptr<FileSink> OpenSink(const std::string &path, const std::string &mode, size_t window,
+                                          std::string *error) {
+  int flags = O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC;
+  if (mode == "direct") {
+    int fd = open(path.c_str(), flags | O_DIRECT, 0644);
+    bool direct = fd >= 0;
+    if (!direct && errno == EINVAL) {
+      fd = open(path.c_str(), flags, 0644);
+    }
+    if (fd < 0) {
+      *error = path + ": " + std::strerror(errno);
+      return nullptr;
+    }
+    return std::unique_ptr<FileSink>(new DirectSink(fd, window, direct));
+  }
+  int fd = open(path.c_str(), flags, 0644);
+  if (fd < 0) {
+    *error = path + ": " + std::strerror(errno);
+    return nullptr;
+  }
+  return std::unique_ptr<FileSink>(new MappedSink(fd, window));
+}
+
+}  // namespace file_io
@@ -0,0 +1,233 @@
+#pragma once
+/**
+ * @file memory_monitor.hpp
+ * @brief Periodic memory sampler for long running servers.
+ * @details A background thread takes one sample per interval:
+ * - rss_kb: resident set size, from /proc/self/statm.
+ * - heap_kb: bytes the allocator handed out and did not get back. Taken from
+ *   tcmalloc or jemalloc when one is linked in (found through weak symbols),
+ *   from glibc's mallinfo2() otherwise.
+ * - one column per gauge the application registered (live streams, bytes
+ *   held by handlers, ...).
+ * Samples are appended to a CSV file and kept for Steady(), which fits a line
+ * through the samples after a warmup. rss growing while heap is flat points
+ * at fragmentation or allocator caching, heap growing with it at a leak, and
+ * a gauge growing as well at whoever owns it.
+ */
+
+#include <unistd.h>  // sysconf
+
+#if defined(__GLIBC__)
+#include <malloc.h>  // mallinfo2
+#endif
+
+#include <chrono>              // std::chrono
+#include <condition_variable>  // std::condition_variable
+#include <cstdint>             // std::int64_t
+#include <cstdio>              // std::FILE
+#include <fstream>             // std::ifstream, std::ofstream
+#include <functional>          // std::function
+#include <limits>              // std::numeric_limits
+#include <mutex>               // std::mutex
+#include <string>              // std::string
+#include <thread>              // std::thread
+#include <utility>             // std::pair
+#include <vector>              // std::vector
+
+extern "C" {
+// gperftools tcmalloc
+int MallocExtension_GetNumericProperty(const char *property, size_t *value) __attribute__((weak));
+// jemalloc
+int mallctl(const char *name, void *oldp, size_t *oldlenp, void *newp, size_t newlen) __attribute__((weak));
+}
+
+class MemoryMonitor {
+  typedef std::int64_t i64;
+
+ public:
+  using Gauge = std::function<i64()>;
+
+  struct Summary {
+    size_t samples = 0;
+    i64 max_rss_kb = 0;
+    i64 last_rss_kb = 0;
+    i64 last_heap_kb = 0;
+    double rss_slope_kb_s = 0;
+    double heap_slope_kb_s = 0;
+  };
+
+  /**
+   * @param csv_path file the samples are written to, none if empty.
+   * @param interval time between two samples.
+   */
+  MemoryMonitor(std::string csv_path, std::chrono::milliseconds interval)
+      : csv_path(std::move(csv_path)), interval(interval) {}
+
+  ~MemoryMonitor() { Stop(); }
+
+  /**
+   * @brief Add a column, sampled by calling `gauge`. Call before Start().
+   */
+  void AddGauge(std::string name, Gauge gauge) { gauges.emplace_back(std::move(name), std::move(gauge)); }
+
+  void Start() {
+    if (csv_path.size()) {
+      csv.open(csv_path);
+      csv << "time_ms,rss_kb,heap_kb";
+      for (auto &gauge : gauges) {
+        csv << "," << gauge.first;
+      }
+      csv << std::endl;
+    }
+    start = std::chrono::steady_clock::now();
+    running = true;
+    sampler = std::thread(&MemoryMonitor::Run, this);
+  }
+
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!running) {
+        return;
+      }
+      running = false;
+    }
+    condition.notify_one();
+    sampler.join();
+    csv.close();
+  }
+
+  /**
+   * @brief Peak rss and least squares slopes of rss/heap over the samples
+   * taken after `warmup`.
+   */
+  Summary Steady(std::chrono::milliseconds warmup) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Summary summary;
+    double n = 0, st = 0, stt = 0, sr = 0, str = 0, sh = 0, sth = 0;
+    for (const Sample &sample : samples) {
+      if (sample.time_ms < warmup.count()) {
+        continue;
+      }
+      double t = sample.time_ms / 1000.0;
+      n++;
+      st += t;
+      stt += t * t;
+      sr += sample.rss_kb;
+      str += t * sample.rss_kb;
+      sh += sample.heap_kb;
+      sth += t * sample.heap_kb;
+      summary.max_rss_kb = std::max(summary.max_rss_kb, sample.rss_kb);
+      summary.last_rss_kb = sample.rss_kb;
+      summary.last_heap_kb = sample.heap_kb;
+    }
+    summary.samples = size_t(n);
+    double d = n * stt - st * st;
+    if (n >= 2 && d > 0) {
+      summary.rss_slope_kb_s = (n * str - st * sr) / d;
+      summary.heap_slope_kb_s = (n * sth - st * sh) / d;
+    }
+    return summary;
+  }
+
+  static i64 RssKb() {
+    std::ifstream statm("/proc/self/statm");
+    i64 pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * sysconf(_SC_PAGESIZE) / 1024;
+  }
+
+  /**
+   * @brief Peak rss (VmHWM) since the process started or the last
+   * ResetPeakRss(), in KB.
+   */
+  static i64 PeakRssKb() {
+    std::ifstream status("/proc/self/status");
+    std::string key;
+    while (status >> key) {
+      if (key == "VmHWM:") {
+        i64 kb = 0;
+        status >> kb;
+        return kb;
+      }
+      status.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    }
+    return -1;
+  }
+
+  /**
+   * @brief Start PeakRssKb() over from the current rss (Linux >= 4.0).
+   */
+  static bool ResetPeakRss() {
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    clear_refs << "5";
+    return bool(clear_refs.flush());
+  }
+
+  /**
+   * @brief Heap in use in KB, -1 if no allocator statistics are available.
+   */
+  static i64 HeapKb() {
+    size_t value = 0;
+    if (MallocExtension_GetNumericProperty != nullptr) {
+      if (MallocExtension_GetNumericProperty("generic.current_allocated_bytes", &value)) {
+        return i64(value / 1024);
+      }
+    }
+    if (mallctl != nullptr) {
+      // jemalloc caches its statistics until the epoch is bumped.
+      std::uint64_t epoch = 1;
+      size_t length = sizeof(epoch);
+      mallctl("epoch", &epoch, &length, &epoch, length);
+      length = sizeof(value);
+      if (mallctl("stats.allocated", &value, &length, nullptr, 0) == 0) {
+        return i64(value / 1024);
+      }
+    }
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2();
+    return i64((info.uordblks + info.hblkhd) / 1024);
+#else
+    return -1;
+#endif
+  }
+
+ private:
+  struct Sample {
+    i64 time_ms;
+    i64 rss_kb;
+    i64 heap_kb;
+  };
+
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (running) {
+      lock.unlock();
+      Sample sample{std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start)
+                        .count(),
+                    RssKb(), HeapKb()};
+      if (csv.is_open()) {
+        csv << sample.time_ms << "," << sample.rss_kb << "," << sample.heap_kb;
+        for (auto &gauge : gauges) {
+          csv << "," << gauge.second();
+        }
+        // Flushed per line so a killed server still leaves its series behind.
+        csv << std::endl;
+      }
+      lock.lock();
+      samples.push_back(sample);
+      condition.wait_for(lock, interval, [this] { return !running; });
+    }
+  }
+
+  const std::string csv_path;
+  const std::chrono::milliseconds interval;
+  std::vector<std::pair<std::string, Gauge>> gauges;
+  std::ofstream csv;
+  std::chrono::steady_clock::time_point start;
+  std::vector<Sample> samples;
+  std::thread sampler;
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool running = false;
+};
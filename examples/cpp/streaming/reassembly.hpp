@@ -0,0 +1,219 @@
+#pragma once
+/**
+ * @file reassembly.hpp
+ * @brief Server side of striped uploads: one buffer sent as byte ranges over
+ * several StreamingMethod calls at once.
+ * @details A striped call carries the metadata
+ * - x-transfer-id: the upload it belongs to, chosen by the client;
+ * - x-total-size: size of the whole buffer;
+ * - x-offset: where the call's first payload byte goes, the payloads of its
+ *   Requests follow one another from there.
+ * The first call of a transfer allocates a destination of x-total-size, every
+ * call copies its payload straight into place, and the transfer is complete
+ * once every byte of it arrived. A range overlapping one already written is
+ * refused, so a repeated or overlapping stripe cannot make up for a missing
+ * one. Transfers nobody wrote to for `idle_timeout` are dropped on the next
+ * Open(), so a client that died halfway does not pin its buffer forever, and
+ * no new transfer starts while the buffers in progress would exceed `budget`.
+ */
+
+#include <atomic>    // std::atomic
+#include <chrono>    // std::chrono
+#include <cstdlib>   // std::strtoull
+#include <cstring>   // std::memcpy
+#include <iterator>  // std::prev
+#include <map>       // std::map, std::multimap
+#include <memory>    // std::shared_ptr, std::unique_ptr
+#include <mutex>     // std::mutex, std::lock_guard
+#include <string>    // std::string
+
+#include <grpcpp/grpcpp.h>
+
+namespace reassembly {
+
+constexpr char kTransferId[] = "x-transfer-id";
+constexpr char kTotalSize[] = "x-total-size";
+constexpr char kOffset[] = "x-offset";
+
+class Transfer {
+  using Clock = std::chrono::steady_clock;
+
+ public:
+  Transfer(std::string id, size_t size)
+      : id(std::move(id)),
+        size(size),
+        buffer(new char[size]),
+        start(Clock::now()),
+        touched(start.time_since_epoch().count()) {}
+
+  /**
+   * @brief Copy `n` bytes to `offset`. False if they do not fit or overlap
+   * bytes written before.
+   */
+  bool Write(size_t offset, const void *data, size_t n) {
+    if (offset > size || n > size - offset) {
+      return false;
+    }
+    if (n == 0) {
+      return true;
+    }
+    if (!Cover(offset, offset + n)) {
+      return false;
+    }
+    // The range is ours alone now, copy it outside the lock; `received` only
+    // counts copied bytes, so Complete() never sees a copy in flight.
+    std::memcpy(buffer.get() + offset, data, n);
+    received += n;
+    touched = Clock::now().time_since_epoch().count();
+    return true;
+  }
+
+  bool Complete() const { return received >= size; }
+
+  const std::string &Id() const { return id; }
+  size_t Size() const { return size; }
+  const char *Data() const { return buffer.get(); }
+  Clock::duration Elapsed() const { return Clock::now() - start; }
+  Clock::duration Idle() const { return Clock::now().time_since_epoch() - Clock::duration(touched.load()); }
+
+ private:
+  /**
+   * @brief Add [begin, end) to the written ranges. False if it overlaps one.
+   * Ranges that touch are merged: a call writes its stripe in order, so each
+   * call keeps extending one range.
+   */
+  bool Cover(size_t begin, size_t end) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto next = covered.upper_bound(begin);
+    if (next != covered.end() && next->first < end) {
+      return false;
+    }
+    if (next != covered.begin()) {
+      auto prev = std::prev(next);
+      if (prev->second > begin) {
+        return false;
+      }
+      if (prev->second == begin) {
+        begin = prev->first;
+        covered.erase(prev);
+      }
+    }
+    if (next != covered.end() && next->first == end) {
+      end = next->second;
+      covered.erase(next);
+    }
+    covered.emplace(begin, end);
+    return true;
+  }
+
+  const std::string id;
+  const size_t size;
+  std::unique_ptr<char[]> buffer;
+  std::mutex mutex;
+  std::map<size_t, size_t> covered;  // written ranges, begin -> end
+  const Clock::time_point start;
+  std::atomic<size_t> received{0};
+  std::atomic<Clock::rep> touched;
+};
+
+class Transfers {
+ public:
+  using Metadata = std::multimap<grpc::string_ref, grpc::string_ref>;
+
+  /**
+   * @param max_size largest transfer accepted, 0 for any.
+   * @param budget most bytes allocated for all transfers in progress, 0 for
+   * no limit.
+   */
+  Transfers(size_t max_size, size_t budget, std::chrono::seconds idle_timeout)
+      : max_size(max_size), budget(budget), idle_timeout(idle_timeout) {}
+
+  /**
+   * @brief Find or start the transfer a call belongs to. Leaves `transfer`
+   * empty for an ordinary, unstriped call.
+   */
+  grpc::Status Open(const Metadata &metadata, std::shared_ptr<Transfer> *transfer, size_t *offset) {
+    auto id = metadata.find(kTransferId);
+    if (id == metadata.end()) {
+      return grpc::Status::OK;
+    }
+    size_t total = 0;
+    if (!Number(metadata, kTotalSize, &total) || !Number(metadata, kOffset, offset) || *offset > total) {
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "striped call needs x-total-size and x-offset");
+    }
+    if (max_size > 0 && total > max_size) {
+      return grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "transfer too large");
+    }
+    std::string key(id->second.data(), id->second.size());
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = transfers.begin(); it != transfers.end();) {
+      if (it->second->Idle() > idle_timeout) {
+        allocated -= it->second->Size();
+        it = transfers.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    auto found = transfers.find(key);
+    if (found == transfers.end()) {
+      if (budget > 0 && (total > budget || allocated > budget - total)) {
+        return grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "transfer budget exhausted");
+      }
+      found = transfers.emplace(key, std::make_shared<Transfer>(key, total)).first;
+      allocated += total;
+    }
+    std::shared_ptr<Transfer> &entry = found->second;
+    if (entry->Size() != total) {
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "x-total-size differs from the transfer's");
+    }
+    *transfer = entry;
+    return grpc::Status::OK;
+  }
+
+  /**
+   * @brief A call of `transfer` ended. True, once, if that completed the
+   * transfer; it is then forgotten and freed with the last reference.
+   */
+  bool Close(const std::shared_ptr<Transfer> &transfer) {
+    if (!transfer->Complete()) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = transfers.find(transfer->Id());
+    if (it == transfers.end() || it->second != transfer) {
+      return false;
+    }
+    allocated -= transfer->Size();
+    transfers.erase(it);
+    completed++;
+    return true;
+  }
+
+  /**
+   * @brief Bytes of destination buffers allocated for transfers in progress.
+   */
+  size_t Allocated() const { return allocated; }
+  size_t Completed() const { return completed; }
+
+ private:
+  static bool Number(const Metadata &metadata, const char *key, size_t *value) {
+    auto it = metadata.find(key);
+    if (it == metadata.end()) {
+      return false;
+    }
+    std::string text(it->second.data(), it->second.size());
+    char *end = nullptr;
+    *value = std::strtoull(text.c_str(), &end, 10);
+    return !text.empty() && *end == '\0';
+  }
+
+  const size_t max_size;
+  const size_t budget;
+  const std::chrono::seconds idle_timeout;
+  std::mutex mutex;
+  std::map<std::string, std::shared_ptr<Transfer>> transfers;
+  std::atomic<size_t> allocated{0};
+  std::atomic<size_t> completed{0};
+};
+
+}  // namespace reassembly
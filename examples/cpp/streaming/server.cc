@@ -16,10 +16,18 @@
  *
  */
 
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <memory>
 #include <string>
 #include <thread>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/strings/str_format.h"
+
 #include <grpcpp/ext/proto_server_reflection_plugin.h>
 #include <grpcpp/grpcpp.h>
 #include <grpcpp/health_check_service_interface.h>
@@ -30,34 +38,143 @@
 #include "data.grpc.pb.h"
 #endif
 
+#include "ack_policy.hpp"
+#include "admission.hpp"
+#include "byte_budget.hpp"
+#include "file_io.hpp"
+#include "memory_monitor.hpp"
+#include "reassembly.hpp"
+#include "zero_copy.hpp"
+
+ABSL_FLAG(uint16_t, port, 50051, "Server port for the service");
+ABSL_FLAG(bool, zero_copy, false, "serve StreamingMethod on raw ByteBuffers, the payload is never copied");
+ABSL_FLAG(uint32_t, async_cqs, 0, "serve StreamingMethod on this many completion queues, one thread each (0: sync handler)");
+ABSL_FLAG(uint32_t, stream_window_kb, 0, "fixed HTTP/2 receive window per stream (0: gRPC default, grows with BDP)");
+ABSL_FLAG(uint32_t, quota_mb, 0, "grpc::ResourceQuota memory limit for the whole server (0: unlimited)");
+ABSL_FLAG(uint32_t, max_threads, 0, "grpc::ResourceQuota thread limit, caps the sync server's threads (0: unlimited)");
+ABSL_FLAG(uint32_t, max_concurrent_streams, 0, "HTTP/2 MAX_CONCURRENT_STREAMS per connection (0: unlimited)");
+ABSL_FLAG(uint32_t, max_active_streams, 0, "StreamingMethod calls running at once, the rest queue or are shed (0: unlimited)");
+ABSL_FLAG(uint32_t, max_queued_streams, 0, "StreamingMethod calls waiting for a slot (0: unlimited)");
+ABSL_FLAG(uint32_t, queue_timeout_ms, 0, "how long a call waits for a slot before RESOURCE_EXHAUSTED (0: shed at once)");
+ABSL_FLAG(uint32_t, stream_budget_mb, 0, "largest Request a stream may receive, the max receive message size (0: unlimited)");
+ABSL_FLAG(uint32_t, held_budget_mb, 0, "payload bytes all handlers together may hold, a stream waits for room (0: unlimited)");
+ABSL_FLAG(uint32_t, max_transfer_mb, 4096, "largest striped upload accepted, its destination is allocated up front (0: any)");
+ABSL_FLAG(uint32_t, transfer_budget_mb, 8192,
+          "most MB allocated for all striped uploads in progress, new ones get RESOURCE_EXHAUSTED past it (0: no limit)");
+ABSL_FLAG(uint32_t, transfer_timeout_s, 60, "a striped upload nobody wrote to for this long is dropped");
+ABSL_FLAG(uint32_t, ack_every, 0,
+          "ack every this many Requests with one Response (0: no count limit if --ack_every_kb or "
+          "--ack_interval_ms is set, else every Request)");
+ABSL_FLAG(uint32_t, ack_every_kb, 0, "ack once this many payload KB arrived since the last ack (0: no byte limit)");
+ABSL_FLAG(uint32_t, ack_interval_ms, 0,
+          "ack the first Request arriving this long after the last ack (0: no time limit); only checked when a "
+          "Request arrives, a quiet stream is acked when it sends again or ends");
+ABSL_FLAG(bool, ack_buffer_hint, false, "write acks with buffer_hint, an ack leaves with the next write or the status");
+ABSL_FLAG(std::string, sink_dir, "", "write each unstriped stream's payload to a file in this directory (empty: drop it)");
+ABSL_FLAG(std::string, sink, "mmap", "how a stream is written: mmap (window by window through a shared mapping) or direct (O_DIRECT)");
+ABSL_FLAG(uint32_t, sink_window_mb, 8, "mmap: bytes mapped at once; direct: size of the aligned write buffer");
+ABSL_FLAG(bool, sink_keep, false, "keep the files written to --sink_dir, they are removed once complete otherwise");
+ABSL_FLAG(std::string, memory_csv, "", "write a memory sample (rss, heap, streams, held bytes) per interval to this CSV");
+ABSL_FLAG(uint32_t, sample_ms, 1000, "memory sampling interval");
+ABSL_FLAG(uint32_t, soak_seconds, 0, "soak test: exit after this long, status 1 if steady state rss exceeds --max_rss_mb");
+ABSL_FLAG(uint32_t, soak_warmup_seconds, 30, "soak test: samples before this are not steady state");
+ABSL_FLAG(uint32_t, max_rss_mb, 1024, "soak test: bound for the steady state rss");
+
+using grpc::ByteBuffer;
+using grpc::CallbackServerContext;
 using grpc::Server;
+using grpc::ServerBidiReactor;
 using grpc::ServerBuilder;
 using grpc::ServerContext;
 using grpc::Status;
 using grpc::ServerReader;
 using grpc::ServerWriter;
 using grpc::ServerReaderWriter;
+using grpc::WriteOptions;
 using data::GRPCDemo;
 using data::Request;
 using data::Response;
 using namespace std;
 // Logic and data behind the server's behavior.
-class GRPCDemoServiceImpl final : public GRPCDemo::Service {
+class GRPCDemoServiceImpl : public GRPCDemo::Service {
   Status StreamingMethod(ServerContext* context, ServerReaderWriter<Response,Request>* stream) override {
+    if (!admission_->Enter()) {
+      return Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "too many streams, retry later");
+    }
+    // A stripe of a striped upload goes into the transfer's buffer.
+    std::shared_ptr<reassembly::Transfer> transfer;
+    size_t offset = 0;
+    Status status = transfers_->Open(context->client_metadata(), &transfer, &offset);
+    if (!status.ok()) {
+      admission_->Leave();
+      return status;
+    }
+    std::string sink_path;
+    std::unique_ptr<file_io::FileSink> sink;
+    if (!transfer) {
+      status = OpenSink(&sink, &sink_path);
+      if (!status.ok()) {
+        admission_->Leave();
+        return status;
+      }
+    }
     Request req;
+    Response reply;
+    AckPolicy acks(*ack_options_);
     int id=0;
     double total_length=0;
+    live_streams++;
     while (stream->Read(&req)) {
-      Response reply;
+      // The Request and its copy are held until it is acked or not. Past
+      // the budget the next Read waits, which pushes back on the client
+      // through flow control.
+      int64_t held = 2 * req.data().size();
+      held_budget_->Acquire(held);
       std::string string_data (req.data());
+      held_bytes += held;
+      received_bytes += string_data.size();
+      if (transfer) {
+        if (!transfer->Write(offset, req.data().data(), req.data().size())) {
+          held_bytes -= held;
+          held_budget_->Release(held);
+          status = Status(grpc::StatusCode::OUT_OF_RANGE, "stripe runs past x-total-size or overlaps another");
+          break;
+        }
+        offset += req.data().size();
+      } else if (sink && !sink->Write(req.data().data(), req.data().size())) {
+        held_bytes -= held;
+        held_budget_->Release(held);
+        status = Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "cannot write " + sink_path);
+        break;
+      }
       //reply.set_data(string_data);
-      reply.set_data("");
-      stream->Write(reply);
+      if (acks.Received(req.data().size(), req.ack_now())) {
+        reply.set_acked_bytes(acks.Ack());
+        stream->Write(reply, AckWriteOptions(req.ack_now()));
+      }
       total_length+=string_data.length();
       id++;
+      held_bytes -= held;
+      held_budget_->Release(held);
+    }
+    live_streams--;
+    admission_->Leave();
+    if (transfer && transfers_->Close(transfer)) {
+      Reassembled(*transfer);
+    }
+    if (sink) {
+      Status closed = CloseSink(std::move(sink), sink_path);
+      if (status.ok()) {
+        status = closed;
+      }
+    }
+    if (status.ok() && acks.Pending()) {
+      // The last ack goes out together with the status.
+      reply.set_acked_bytes(acks.Ack());
+      stream->Write(reply, WriteOptions().set_last_message());
     }
     //cout<<"=== server streaming recv&send:"<<total_length/1024/1024 <<" MB"<<endl;
-    return Status::OK;
+    return status;
   }
 
   Status UnaryMethod(ServerContext* context, const Request *request,Response *reply) override {
@@ -66,41 +183,546 @@ class GRPCDemoServiceImpl final : public GRPCDemo::Service {
     //cout<<"=== server unary recv&send:"<<reply->data().size()/1024/1024 <<" MB"<<endl;
     return Status::OK;
   }
+
+ public:
+  // Admission control and the budget for payload held by handlers, both
+  // process wide and owned by RunServer.
+  void Limit(Admission* admission, ByteBudget* held_budget) {
+    admission_ = admission;
+    held_budget_ = held_budget;
+  }
+
+  // Striped uploads in progress, process wide and owned by RunServer.
+  void Reassemble(reassembly::Transfers* transfers) { transfers_ = transfers; }
+
+  // Where unstriped streams are written, owned by main. Empty dir: nowhere.
+  struct SinkOptions {
+    std::string dir;
+    std::string mode;
+    size_t window;
+    bool keep;
+  };
+  void Sink(const SinkOptions* sink) { sink_ = sink; }
+
+  // When streams are acked, owned by main.
+  void Acks(const AckOptions* ack_options) { ack_options_ = ack_options; }
+
+  // Instrumentation for the memory monitor. Process wide, RunServer builds a
+  // new service instance on every restart.
+  static std::atomic<int64_t> live_streams;    // StreamingMethod calls running
+  static std::atomic<int64_t> held_bytes;      // payload bytes handlers hold on to
+  static std::atomic<int64_t> received_bytes;  // payload bytes received so far
+  static std::atomic<int64_t> sink_bytes;      // payload bytes written to --sink_dir
+
+ protected:
+  // The destination would be handed on from here, this demo only drops it.
+  static void Reassembled(const reassembly::Transfer& transfer) {
+    //cout<<"=== transfer "<<transfer.Id()<<" reassembled:"<<transfer.Size()/1024/1024<<" MB"<<endl;
+  }
+
+  // An ack the client asked for with `ack_now` is never held back, the
+  // client writes nothing more until it arrives.
+  WriteOptions AckWriteOptions(bool ack_now) const {
+    WriteOptions options;
+    if (ack_options_->buffer_hint && !ack_now) {
+      options.set_buffer_hint();
+    }
+    return options;
+  }
+
+  // A file for the next stream, or none if streams are not written out.
+  Status OpenSink(std::unique_ptr<file_io::FileSink>* sink, std::string* path) const {
+    static std::atomic<uint64_t> streams{0};
+    if (sink_ == nullptr || sink_->dir.empty()) {
+      return Status::OK;
+    }
+    *path = absl::StrFormat("%s/stream-%d-%d.bin", sink_->dir, getpid(), streams++);
+    std::string error;
+    *sink = file_io::OpenSink(*path, sink_->mode, sink_->window, &error);
+    if (!*sink) {
+      return Status(grpc::StatusCode::RESOURCE_EXHAUSTED, error);
+    }
+    return Status::OK;
+  }
+
+  // The file would be handed on from here, like a reassembled transfer.
+  Status CloseSink(std::unique_ptr<file_io::FileSink> sink, const std::string& path) const {
+    bool ok = sink->Close();
+    sink_bytes += sink->Written();
+    if (!sink_->keep) {
+      unlink(path.c_str());
+    }
+    return ok ? Status::OK : Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "cannot write " + path);
+  }
+
+  Admission* admission_ = nullptr;
+  ByteBudget* held_budget_ = nullptr;
+  reassembly::Transfers* transfers_ = nullptr;
+  const SinkOptions* sink_ = nullptr;
+  const AckOptions* ack_options_ = nullptr;
+};
+std::atomic<int64_t> GRPCDemoServiceImpl::live_streams{0};
+std::atomic<int64_t> GRPCDemoServiceImpl::held_bytes{0};
+std::atomic<int64_t> GRPCDemoServiceImpl::received_bytes{0};
+std::atomic<int64_t> GRPCDemoServiceImpl::sink_bytes{0};
+
+// StreamingMethod without (de)serialization: a Request arrives as the slices
+// the transport read it into and its `data` is looked at in place, instead of
+// being copied into the message and then into another std::string. An ack
+// is a Response of a few bytes built by hand. UnaryMethod stays on
+// the synchronous implementation above. Reactions must not block, so a call
+// that finds no free slot is shed at once rather than queued, and payload
+// only lives for the duration of OnReadDone, outside the held budget.
+class GRPCDemoZeroCopyServiceImpl final
+    : public GRPCDemo::WithRawCallbackMethod_StreamingMethod<GRPCDemoServiceImpl> {
+  ServerBidiReactor<ByteBuffer, ByteBuffer>* StreamingMethod(CallbackServerContext* context) override {
+    class Receiver : public ServerBidiReactor<ByteBuffer, ByteBuffer> {
+     public:
+      Receiver(CallbackServerContext* context, const GRPCDemoZeroCopyServiceImpl* service)
+          : service_(service),
+            admission_(service->admission_),
+            transfers_(service->transfers_),
+            acks_(*service->ack_options_) {
+        if (!admission_->TryEnter()) {
+          admission_ = nullptr;
+          Finish(Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "too many streams, retry later"));
+          return;
+        }
+        Status status = transfers_->Open(context->client_metadata(), &transfer_, &offset_);
+        if (!status.ok()) {
+          admission_->Leave();
+          admission_ = nullptr;
+          Finish(status);
+          return;
+        }
+        if (!transfer_) {
+          status = service_->OpenSink(&sink_, &sink_path_);
+          if (!status.ok()) {
+            admission_->Leave();
+            admission_ = nullptr;
+            Finish(status);
+            return;
+          }
+        }
+        live_streams++;
+        StartRead(&req_);
+      }
+
+      void OnReadDone(bool ok) override {
+        if (!ok) {
+          //cout<<"=== server zero copy recv&send:"<<total_length_/1024/1024 <<" MB"<<endl;
+          Status status = sink_ ? service_->CloseSink(std::move(sink_), sink_path_) : Status::OK;
+          if (status.ok() && acks_.Pending()) {
+            // The last ack goes out together with the status.
+            reply_ = zero_copy::WrapAck(acks_.Ack());
+            StartWriteAndFinish(&reply_, WriteOptions(), status);
+          } else {
+            Finish(status);
+          }
+          return;
+        }
+        std::vector<grpc::Slice> slices;
+        bool ack_now = false;
+        if (!req_.Dump(&slices).ok() || !zero_copy::RequestPayload(slices, &payload_, &ack_now)) {
+          Finish(Status(grpc::StatusCode::INVALID_ARGUMENT, "malformed Request"));
+          return;
+        }
+        int64_t held = 0;
+        for (const auto& span : payload_) {
+          // Striped: the one copy, from the transport's slices into place.
+          if (transfer_ && !transfer_->Write(offset_ + held, span.data, span.size)) {
+            Finish(Status(grpc::StatusCode::OUT_OF_RANGE, "stripe runs past x-total-size or overlaps another"));
+            return;
+          }
+          // Unstriped: the one copy, from the transport's slices to the file.
+          if (sink_ && !sink_->Write(span.data, span.size)) {
+            Finish(Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "cannot write " + sink_path_));
+            return;
+          }
+          held += span.size;
+        }
+        offset_ += held;
+        received_bytes += held;
+        total_length_ += held;
+        // Drop our references now rather than on the next read.
+        payload_.clear();
+        req_.Clear();
+        if (acks_.Received(held, ack_now)) {
+          reply_ = zero_copy::WrapAck(acks_.Ack());
+          StartWrite(&reply_, service_->AckWriteOptions(ack_now));
+        } else {
+          StartRead(&req_);
+        }
+      }
+
+      void OnWriteDone(bool ok) override {
+        if (!ok) {
+          Finish(Status(grpc::StatusCode::UNKNOWN, "Unexpected Failure"));
+          return;
+        }
+        StartRead(&req_);
+      }
+
+      void OnDone() override {
+        if (admission_ != nullptr) {
+          live_streams--;
+          admission_->Leave();
+        }
+        if (transfer_ && transfers_->Close(transfer_)) {
+          Reassembled(*transfer_);
+        }
+        if (sink_) {
+          service_->CloseSink(std::move(sink_), sink_path_);
+        }
+        delete this;
+      }
+
+     private:
+      const GRPCDemoZeroCopyServiceImpl* service_;
+      Admission* admission_;
+      reassembly::Transfers* transfers_;
+      AckPolicy acks_;
+      std::shared_ptr<reassembly::Transfer> transfer_;
+      size_t offset_ = 0;
+      std::unique_ptr<file_io::FileSink> sink_;
+      std::string sink_path_;
+      ByteBuffer req_;
+      ByteBuffer reply_;
+      std::vector<zero_copy::Span> payload_;
+      double total_length_ = 0;
+    };
+    return new Receiver(context, this);
+  }
 };
-void doShutdown(std::unique_ptr<Server>& server)
-{   
-    sleep(30);
-    server->Shutdown();        
-    std::cout << "Server is shutting down. "<< std::endl;
-}
 
-void RunServer() {
-  while(true){
-    std::string server_address("0.0.0.0:50051");
-    GRPCDemoServiceImpl service;
-    grpc::EnableDefaultHealthCheckService(true);
-    grpc::reflection::InitProtoReflectionServerBuilderPlugin();
-    ServerBuilder builder;
+// StreamingMethod on the asynchronous API: every stream is a small state
+// machine driven by completion queue events, so any number of streams is
+// served by the `--async_cqs` threads draining the queues instead of one sync
+// server thread per stream. A stream has at most one operation in flight, a
+// Read or the Write of an ack, and the StreamCall itself is the tag. UnaryMethod
+// stays on the synchronous implementation. As with the zero copy reactor, a
+// call that finds no free slot is shed at once and payload lives only while
+// its Read event is handled.
+class GRPCDemoAsyncServiceImpl final : public GRPCDemo::WithAsyncMethod_StreamingMethod<GRPCDemoServiceImpl> {
+ public:
+  // Drains `cq` until it is shut down. Runs on a thread of its own per queue.
+  void HandleRpcs(grpc::ServerCompletionQueue* cq) {
+    new StreamCall(this, cq);
+    void* tag;  // the StreamCall the event belongs to
+    bool ok;
+    while (cq->Next(&tag, &ok)) {
+      static_cast<StreamCall*>(tag)->Proceed(ok);
+    }
+  }
+
+ private:
+  class StreamCall {
+   public:
+    StreamCall(GRPCDemoAsyncServiceImpl* service, grpc::ServerCompletionQueue* cq)
+        : service_(service), cq_(cq), stream_(&ctx_), acks_(*service->ack_options_) {
+      // Ask for the next StreamingMethod call, this instance is its tag.
+      service_->RequestStreamingMethod(&ctx_, &stream_, cq_, cq_, this);
+    }
+
+    void Proceed(bool ok) {
+      switch (state_) {
+        case REQUEST:
+          if (!ok) {
+            delete this;  // the server is shutting down
+            return;
+          }
+          // Post a replacement for the next client, then start this one.
+          new StreamCall(service_, cq_);
+          Start();
+          break;
+        case READ:
+          if (!ok) {
+            Ended();
+            return;
+          }
+          Received();
+          break;
+        case WRITE:
+          if (!ok) {
+            Finish(Status(grpc::StatusCode::UNKNOWN, "Unexpected Failure"));
+            return;
+          }
+          Read();
+          break;
+        case FINISH:
+          Done();
+          break;
+      }
+    }
+
+   private:
+    void Start() {
+      admission_ = service_->admission_;
+      if (!admission_->TryEnter()) {
+        admission_ = nullptr;
+        Finish(Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "too many streams, retry later"));
+        return;
+      }
+      Status status = service_->transfers_->Open(ctx_.client_metadata(), &transfer_, &offset_);
+      if (status.ok() && !transfer_) {
+        status = service_->OpenSink(&sink_, &sink_path_);
+      }
+      if (!status.ok()) {
+        admission_->Leave();
+        admission_ = nullptr;
+        Finish(status);
+        return;
+      }
+      live_streams++;
+      Read();
+    }
+
+    void Read() {
+      state_ = READ;
+      stream_.Read(&req_, this);
+    }
+
+    void Received() {
+      const std::string& data = req_.data();
+      if (transfer_ && !transfer_->Write(offset_, data.data(), data.size())) {
+        Finish(Status(grpc::StatusCode::OUT_OF_RANGE, "stripe runs past x-total-size or overlaps another"));
+        return;
+      }
+      if (sink_ && !sink_->Write(data.data(), data.size())) {
+        Finish(Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "cannot write " + sink_path_));
+        return;
+      }
+      offset_ += data.size();
+      received_bytes += data.size();
+      bool ack_now = req_.ack_now();
+      bool ack = acks_.Received(data.size(), ack_now);
+      req_.Clear();
+      if (!ack) {
+        Read();
+        return;
+      }
+      reply_.set_acked_bytes(acks_.Ack());
+      state_ = WRITE;
+      stream_.Write(reply_, service_->AckWriteOptions(ack_now), this);
+    }
+
+    // The client is done writing.
+    void Ended() {
+      Status status = sink_ ? service_->CloseSink(std::move(sink_), sink_path_) : Status::OK;
+      if (!status.ok() || !acks_.Pending()) {
+        Finish(status);
+        return;
+      }
+      // The last ack goes out together with the status.
+      reply_.set_acked_bytes(acks_.Ack());
+      state_ = FINISH;
+      stream_.WriteAndFinish(reply_, WriteOptions(), status, this);
+    }
+
+    void Finish(const Status& status) {
+      state_ = FINISH;
+      stream_.Finish(status, this);
+    }
+
+    void Done() {
+      if (admission_ != nullptr) {
+        live_streams--;
+        admission_->Leave();
+      }
+      if (transfer_ && service_->transfers_->Close(transfer_)) {
+        Reassembled(*transfer_);
+      }
+      if (sink_) {
+        service_->CloseSink(std::move(sink_), sink_path_);
+      }
+      delete this;
+    }
+
+    GRPCDemoAsyncServiceImpl* service_;
+    grpc::ServerCompletionQueue* cq_;
+    ServerContext ctx_;
+    grpc::ServerAsyncReaderWriter<Response, Request> stream_;
+    enum State { REQUEST, READ, WRITE, FINISH };
+    State state_ = REQUEST;
+    AckPolicy acks_;
+    Admission* admission_ = nullptr;
+    std::shared_ptr<reassembly::Transfer> transfer_;
+    size_t offset_ = 0;
+    std::unique_ptr<file_io::FileSink> sink_;
+    std::string sink_path_;
+    Request req_;
+    Response reply_;
+  };
+};
+
+struct ServerOptions {
+  uint16_t port;
+  bool zero_copy;
+  uint32_t async_cqs;  // 0: sync StreamingMethod
+  uint32_t stream_window_kb;
+  uint32_t quota_mb;
+  uint32_t max_threads;
+  uint32_t max_concurrent_streams;
+  uint32_t max_active_streams;
+  uint32_t max_queued_streams;
+  uint32_t queue_timeout_ms;
+  uint32_t stream_budget_mb;
+  uint32_t held_budget_mb;
+};
+
+// Memory is bounded by admission control instead of restarting the server:
+// a ResourceQuota for gRPC's own buffers, a cap on streams per connection
+// and on StreamingMethod calls overall (the rest wait or get
+// RESOURCE_EXHAUSTED), the largest message one stream may receive and a
+// budget for the payload handlers hold at once. Striped uploads are
+// reassembled into `transfers`, other streams written to `sink`. Streams are
+// acked as `acks` says.
+void RunServer(const ServerOptions& options, reassembly::Transfers* transfers,
+               const GRPCDemoServiceImpl::SinkOptions* sink, const AckOptions* acks) {
+  std::string server_address = absl::StrFormat("0.0.0.0:%d", options.port);
+  Admission admission(options.max_active_streams, options.max_queued_streams,
+                      std::chrono::milliseconds(options.queue_timeout_ms));
+  ByteBudget held_budget(size_t(options.held_budget_mb) * 1024 * 1024);
+  GRPCDemoServiceImpl sync_service;
+  GRPCDemoZeroCopyServiceImpl zero_copy_service;
+  GRPCDemoAsyncServiceImpl async_service;
+  GRPCDemoServiceImpl& service = options.zero_copy        ? zero_copy_service
+                                 : options.async_cqs > 0 ? async_service
+                                                         : sync_service;
+  service.Limit(&admission, &held_budget);
+  service.Reassemble(transfers);
+  service.Sink(sink);
+  service.Acks(acks);
+  grpc::EnableDefaultHealthCheckService(true);
+  grpc::reflection::InitProtoReflectionServerBuilderPlugin();
+  ServerBuilder builder;
+  if (options.stream_budget_mb > 0) {
+    builder.SetMaxReceiveMessageSize(options.stream_budget_mb * 1024 * 1024);
+  } else {
     builder.SetMaxReceiveMessageSize(-1);  // mydebug server set max message size;
-    builder.SetMaxSendMessageSize(-1);
-    // Listen on the given address without any authentication mechanism.
-    builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
-    // Register "service" as the instance through which we'll communicate with
-    // clients. In this case it corresponds to an *synchronous* service.
-    builder.RegisterService(&service);
-    // Finally assemble the server.
-    std::unique_ptr<Server> server(builder.BuildAndStart());
-    std::cout << "Server listening on " << server_address << std::endl;
-    std::thread task_monitor = std::thread([&] { doShutdown(server); });
-    task_monitor.detach();
-    // Wait for the server to shutdown. Note that some other thread must be
-    // responsible for shutting down the server for this call to ever return.
-    server->Wait();
+  }
+  builder.SetMaxSendMessageSize(-1);
+  grpc::ResourceQuota quota("data_server");
+  if (options.quota_mb > 0) {
+    quota.Resize(size_t(options.quota_mb) * 1024 * 1024);
+  }
+  if (options.max_threads > 0) {
+    quota.SetMaxThreads(options.max_threads);
+  }
+  builder.SetResourceQuota(quota);
+  if (options.max_concurrent_streams > 0) {
+    builder.AddChannelArgument(GRPC_ARG_MAX_CONCURRENT_STREAMS, options.max_concurrent_streams);
+  }
+  if (options.stream_window_kb > 0) {
+    // What a stream may have received but not yet read is capped by its
+    // flow control window. Fix it instead of letting BDP probing grow it,
+    // so a fast client is held back by the transport, not buffered here.
+    builder.AddChannelArgument(GRPC_ARG_HTTP2_STREAM_LOOKAHEAD_BYTES, options.stream_window_kb * 1024);
+    builder.AddChannelArgument(GRPC_ARG_HTTP2_BDP_PROBE, 0);
+  }
+  // Listen on the given address without any authentication mechanism.
+  builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
+  // Register "service" as the instance through which we'll communicate with
+  // clients. In this case it corresponds to an *synchronous* service, with
+  // StreamingMethod on the callback API in zero copy mode and on completion
+  // queues in async mode.
+  builder.RegisterService(&service);
+  std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> cqs;
+  for (uint32_t i = 0; i < options.async_cqs; ++i) {
+    cqs.push_back(builder.AddCompletionQueue());
+  }
+  // Finally assemble the server.
+  std::unique_ptr<Server> server(builder.BuildAndStart());
+  std::cout << "Server listening on " << server_address << std::endl;
+  std::vector<std::thread> cq_threads;
+  for (auto& cq : cqs) {
+    cq_threads.emplace_back(&GRPCDemoAsyncServiceImpl::HandleRpcs, &async_service, cq.get());
+  }
+  // Wait for the server to shutdown. Note that some other thread must be
+  // responsible for shutting down the server for this call to ever return.
+  server->Wait();
+  // Always shutdown the completion queues after the server.
+  for (auto& cq : cqs) {
+    cq->Shutdown();
+  }
+  for (auto& thread : cq_threads) {
+    thread.join();
   }
 }
 
+// Ends a soak test: judges the steady state part of the samples and leaves
+// the process. RunServer never returns, so this does not either.
+void FinishSoak(MemoryMonitor& monitor, std::chrono::seconds warmup, int64_t max_rss_mb) {
+  monitor.Stop();
+  MemoryMonitor::Summary steady = monitor.Steady(warmup);
+  bool ok = steady.samples > 0 && steady.max_rss_kb <= max_rss_mb * 1024;
+  std::cout << "soak " << (ok ? "passed" : "FAILED") << ": steady samples:" << steady.samples
+            << " max rss:" << steady.max_rss_kb / 1024 << "MB (bound " << max_rss_mb << "MB)"
+            << " rss slope:" << steady.rss_slope_kb_s << "KB/s heap slope:" << steady.heap_slope_kb_s << "KB/s"
+            << " received:" << GRPCDemoServiceImpl::received_bytes / 1024 / 1024 << "MB" << std::endl;
+  // gRPC threads are still serving, skip the destructors.
+  std::_Exit(ok ? 0 : 1);
+}
+
 int main(int argc, char** argv) {
-  RunServer();
+  absl::ParseCommandLine(argc, argv);
+  std::string memory_csv = absl::GetFlag(FLAGS_memory_csv);
+  uint32_t soak_seconds = absl::GetFlag(FLAGS_soak_seconds);
+  reassembly::Transfers transfers(size_t(absl::GetFlag(FLAGS_max_transfer_mb)) * 1024 * 1024,
+                                  size_t(absl::GetFlag(FLAGS_transfer_budget_mb)) * 1024 * 1024,
+                                  std::chrono::seconds(absl::GetFlag(FLAGS_transfer_timeout_s)));
+  GRPCDemoServiceImpl::SinkOptions sink{absl::GetFlag(FLAGS_sink_dir), absl::GetFlag(FLAGS_sink),
+                                        size_t(absl::GetFlag(FLAGS_sink_window_mb)) * 1024 * 1024,
+                                        absl::GetFlag(FLAGS_sink_keep)};
+  if (sink.mode != "mmap" && sink.mode != "direct") {
+    std::cerr << "--sink must be mmap or direct" << std::endl;
+    return 1;
+  }
+  MemoryMonitor monitor(memory_csv, std::chrono::milliseconds(absl::GetFlag(FLAGS_sample_ms)));
+  monitor.AddGauge("live_streams", [] { return GRPCDemoServiceImpl::live_streams.load(); });
+  monitor.AddGauge("held_kb", [] { return GRPCDemoServiceImpl::held_bytes / 1024; });
+  monitor.AddGauge("received_mb", [] { return GRPCDemoServiceImpl::received_bytes / 1024 / 1024; });
+  monitor.AddGauge("transfer_mb", [&transfers] { return int64_t(transfers.Allocated() / 1024 / 1024); });
+  monitor.AddGauge("sink_mb", [] { return GRPCDemoServiceImpl::sink_bytes / 1024 / 1024; });
+  monitor.AddGauge("transfers_done", [&transfers] { return int64_t(transfers.Completed()); });
+  if (!memory_csv.empty() || soak_seconds > 0) {
+    monitor.Start();
+  }
+  if (soak_seconds > 0) {
+    std::thread([&monitor, soak_seconds] {
+      std::this_thread::sleep_for(std::chrono::seconds(soak_seconds));
+      FinishSoak(monitor, std::chrono::seconds(absl::GetFlag(FLAGS_soak_warmup_seconds)),
+                 absl::GetFlag(FLAGS_max_rss_mb));
+    }).detach();
+  }
+  ServerOptions options;
+  options.port = absl::GetFlag(FLAGS_port);
+  options.zero_copy = absl::GetFlag(FLAGS_zero_copy);
+  options.async_cqs = absl::GetFlag(FLAGS_async_cqs);
+  if (options.zero_copy && options.async_cqs > 0) {
+    std::cerr << "--zero_copy and --async_cqs are two ways to serve StreamingMethod, pick one" << std::endl;
+    return 1;
+  }
+  options.stream_window_kb = absl::GetFlag(FLAGS_stream_window_kb);
+  options.quota_mb = absl::GetFlag(FLAGS_quota_mb);
+  options.max_threads = absl::GetFlag(FLAGS_max_threads);
+  options.max_concurrent_streams = absl::GetFlag(FLAGS_max_concurrent_streams);
+  options.max_active_streams = absl::GetFlag(FLAGS_max_active_streams);
+  options.max_queued_streams = absl::GetFlag(FLAGS_max_queued_streams);
+  options.queue_timeout_ms = absl::GetFlag(FLAGS_queue_timeout_ms);
+  options.stream_budget_mb = absl::GetFlag(FLAGS_stream_budget_mb);
+  options.held_budget_mb = absl::GetFlag(FLAGS_held_budget_mb);
+  AckOptions acks;
+  acks.messages = absl::GetFlag(FLAGS_ack_every);
+  acks.bytes = size_t(absl::GetFlag(FLAGS_ack_every_kb)) * 1024;
+  acks.interval = std::chrono::milliseconds(absl::GetFlag(FLAGS_ack_interval_ms));
+  // The limits are OR'ed: a count limit left at 1 would ack every Request
+  // whatever the byte or time limit says.
+  if (acks.messages == 0 && acks.bytes == 0 && acks.interval.count() == 0) {
+    acks.messages = 1;
+  }
+  acks.buffer_hint = absl::GetFlag(FLAGS_ack_buffer_hint);
+  RunServer(options, &transfers, &sink, &acks);
 
   return 0;
 }
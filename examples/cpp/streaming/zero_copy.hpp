@@ -0,0 +1,256 @@
+#pragma once
+/**
+ * @file zero_copy.hpp
+ * @brief Raw wire format helpers for data::Request, used to move the payload
+ * of GRPCDemo/StreamingMethod through gRPC without copying it.
+ * @details The generated code serializes a Request into a fresh buffer on the
+ * way out and parses `data` into a std::string on the way in. Both are full
+ * copies of the payload. Here a Request is assembled as a ByteBuffer of two
+ * slices instead: a few header bytes (tag and length of field `data`) and a
+ * slice that points straight into the caller's buffer. On the receiving side
+ * the ByteBuffer's slices are walked in place and the payload is returned as
+ * pointers into them. The bytes on the wire are exactly those of a serialized
+ * Request, so either side interoperates with the generated stubs. The acks
+ * (Response.acked_bytes) are written and read the same way.
+ */
+
+#include <algorithm>           // std::min
+#include <condition_variable>  // std::condition_variable
+#include <cstdint>             // std::uint8_t, std::uint64_t
+#include <mutex>               // std::mutex, std::unique_lock
+#include <vector>              // std::vector
+
+#include <grpcpp/support/byte_buffer.h>
+#include <grpcpp/support/slice.h>
+
+namespace zero_copy {
+
+constexpr char kStreamingMethod[] = "/data.GRPCDemo/StreamingMethod";
+// Request.data is field 2, length delimited.
+constexpr std::uint64_t kDataField = 2;
+constexpr std::uint8_t kLengthDelimited = 2;
+// Request.ack_now is field 7 and Response.acked_bytes field 4, both varints.
+constexpr std::uint64_t kAckNowField = 7;
+constexpr std::uint64_t kAckedBytesField = 4;
+constexpr std::uint8_t kVarint = 0;
+
+/**
+ * @brief Hands out slices over a caller owned buffer and tracks how many of
+ * them gRPC still holds. A slice may outlive the write that carried it (until
+ * the transport has flushed it), so the buffer must not be freed or reused
+ * before Wait() returns.
+ */
+class PinnedBuffer {
+ public:
+  grpc::Slice Slice(const char *data, size_t length) {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      refs_++;
+    }
+    return grpc::Slice(const_cast<char *>(data), length, &PinnedBuffer::Unref, this);
+  }
+
+  void Wait() {
+    std::unique_lock<std::mutex> lock(mu_);
+    cv_.wait(lock, [this] { return refs_ == 0; });
+  }
+
+ private:
+  static void Unref(void *self) {
+    PinnedBuffer *pinned = static_cast<PinnedBuffer *>(self);
+    std::lock_guard<std::mutex> lock(pinned->mu_);
+    if (--pinned->refs_ == 0) {
+      pinned->cv_.notify_all();
+    }
+  }
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  size_t refs_ = 0;
+};
+
+/**
+ * @brief Serialized Request{data: [data, data+length)} whose payload slice
+ * points into `data`. Only the header (at most 11 bytes) is copied.
+ */
+inline grpc::ByteBuffer WrapRequest(const char *data, size_t length, PinnedBuffer *pin) {
+  std::uint8_t header[11];
+  size_t n = 0;
+  header[n++] = std::uint8_t(kDataField << 3 | kLengthDelimited);
+  std::uint64_t value = length;
+  while (value >= 0x80) {
+    header[n++] = std::uint8_t(value | 0x80);
+    value >>= 7;
+  }
+  header[n++] = std::uint8_t(value);
+  grpc::Slice slices[2] = {grpc::Slice(header, n), pin->Slice(data, length)};
+  return grpc::ByteBuffer(slices, length > 0 ? 2 : 1);
+}
+
+// A piece of a payload that lives inside one of the received slices.
+struct Span {
+  const std::uint8_t *data;
+  size_t size;
+};
+
+// Sequential reader over the slices of a received message.
+class SliceReader {
+ public:
+  explicit SliceReader(const std::vector<grpc::Slice> &slices) : slices_(slices) {}
+
+  bool Done() {
+    SkipEmpty();
+    return index_ == slices_.size();
+  }
+
+  bool ReadVarint(std::uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      SkipEmpty();
+      if (index_ == slices_.size()) {
+        return false;
+      }
+      std::uint8_t byte = slices_[index_].begin()[offset_++];
+      *value |= std::uint64_t(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Advances over `n` bytes, appending the pieces crossed to `spans` if given.
+  bool Skip(std::uint64_t n, std::vector<Span> *spans) {
+    while (n > 0) {
+      SkipEmpty();
+      if (index_ == slices_.size()) {
+        return false;
+      }
+      const grpc::Slice &slice = slices_[index_];
+      size_t take = size_t(std::min<std::uint64_t>(n, slice.size() - offset_));
+      if (spans != nullptr) {
+        spans->push_back({slice.begin() + offset_, take});
+      }
+      offset_ += take;
+      n -= take;
+    }
+    return true;
+  }
+
+ private:
+  void SkipEmpty() {
+    while (index_ < slices_.size() && offset_ == slices_[index_].size()) {
+      index_++;
+      offset_ = 0;
+    }
+  }
+
+  const std::vector<grpc::Slice> &slices_;
+  size_t index_ = 0;
+  size_t offset_ = 0;
+};
+
+/**
+ * @brief Locates Request.data inside a serialized Request without copying it,
+ * and reads Request.ack_now if `ack_now` is given. Unknown fields are skipped.
+ * Returns false if the message is malformed.
+ */
+inline bool RequestPayload(const std::vector<grpc::Slice> &slices, std::vector<Span> *payload,
+                           bool *ack_now = nullptr) {
+  SliceReader reader(slices);
+  payload->clear();
+  if (ack_now != nullptr) {
+    *ack_now = false;
+  }
+  while (!reader.Done()) {
+    std::uint64_t tag, value;
+    if (!reader.ReadVarint(&tag)) {
+      return false;
+    }
+    bool ok = false;
+    switch (tag & 7) {
+      case 0:  // varint
+        ok = reader.ReadVarint(&value);
+        if (ok && ack_now != nullptr && (tag >> 3) == kAckNowField) {
+          *ack_now = value != 0;
+        }
+        break;
+      case 1:  // fixed64
+        ok = reader.Skip(8, nullptr);
+        break;
+      case 2:  // length delimited, the last occurrence of a field wins
+        if ((tag >> 3) == kDataField) {
+          payload->clear();
+          ok = reader.ReadVarint(&value) && reader.Skip(value, payload);
+        } else {
+          ok = reader.ReadVarint(&value) && reader.Skip(value, nullptr);
+        }
+        break;
+      case 5:  // fixed32
+        ok = reader.Skip(4, nullptr);
+        break;
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Serialized Response{acked_bytes: acked}, the ack of the coalescing
+ * server.
+ */
+inline grpc::ByteBuffer WrapAck(std::uint64_t acked) {
+  std::uint8_t bytes[11];
+  size_t n = 0;
+  if (acked > 0) {  // proto3 leaves out a zero
+    bytes[n++] = std::uint8_t(kAckedBytesField << 3 | kVarint);
+    while (acked >= 0x80) {
+      bytes[n++] = std::uint8_t(acked | 0x80);
+      acked >>= 7;
+    }
+    bytes[n++] = std::uint8_t(acked);
+  }
+  grpc::Slice slice(bytes, n);
+  return grpc::ByteBuffer(&slice, 1);
+}
+
+/**
+ * @brief Reads Response.acked_bytes out of a serialized Response. Returns
+ * false if the message is malformed.
+ */
+inline bool AckedBytes(const std::vector<grpc::Slice> &slices, std::uint64_t *acked) {
+  SliceReader reader(slices);
+  *acked = 0;
+  while (!reader.Done()) {
+    std::uint64_t tag, value;
+    if (!reader.ReadVarint(&tag)) {
+      return false;
+    }
+    bool ok = false;
+    switch (tag & 7) {
+      case 0:
+        ok = reader.ReadVarint(&value);
+        if (ok && (tag >> 3) == kAckedBytesField) {
+          *acked = value;
+        }
+        break;
+      case 1:
+        ok = reader.Skip(8, nullptr);
+        break;
+      case 2:
+        ok = reader.ReadVarint(&value) && reader.Skip(value, nullptr);
+        break;
+      case 5:
+        ok = reader.Skip(4, nullptr);
+        break;
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace zero_copy
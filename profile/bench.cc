@@ -0,0 +1,399 @@
+/*
+ * Unified transport benchmark.
+ *
+ * Runs the same request/response workload (a `length` byte payload answered
+ * by a short reply) against every transport the repo profiles, so the numbers
+ * are comparable:
+ *   grpc        Greeter::SayHello, blocking stub      (profile/grpc:server)
+ *   grpc_async  Greeter::SayHello, CompletionQueue    (profile/grpc:server)
+ *   socket      raw TCP, fixed size request           (profile/socket:server)
+ *   http        POST /hello through cpp-httplib       (profile/httplib:server)
+ *
+ * Load is generated by `connections * outstanding` worker threads, each
+ * recording per call latency into its own histogram; the histograms are merged
+ * for the final report. gRPC workers of one connection share its channel, so
+ * `outstanding` is the number of concurrent RPCs per HTTP/2 connection.
+ * Socket and http carry one call at a time, so there every worker opens its
+ * own connection.
+ *
+ * --mode=closed  every worker issues its next call as soon as the previous
+ *                one returns (back-to-back, like profile/grpc:client).
+ * --mode=open    calls are scheduled at a fixed offered load (--qps, split
+ *                evenly across workers) with constant or Poisson inter-arrival
+ *                times. Latency is measured from the *intended* send time, so
+ *                a stalled server shows up as queueing delay instead of being
+ *                hidden by coordinated omission.
+ *
+ *   bazel run //profile:bench -- --transport=socket --target=localhost:50051
+ *   bazel run //profile:bench -- --mode=open --qps=20000 --arrival=poisson
+ */
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+
+#include <grpcpp/grpcpp.h>
+
+#include "profile/histogram.h"
+#include "profile/http/httplib.h"
+
+#ifdef BAZEL_BUILD
+#include "examples/protos/helloworld.grpc.pb.h"
+#else
+#include "helloworld.grpc.pb.h"
+#endif
+
+ABSL_FLAG(std::string, transport, "grpc", "grpc | grpc_async | socket | http");
+ABSL_FLAG(std::string, target, "localhost:50051", "Server address host:port");
+ABSL_FLAG(uint32_t, length, 25000, "request payload size in bytes");
+ABSL_FLAG(uint32_t, loop, 1000, "measured calls per worker");
+ABSL_FLAG(uint32_t, warmup, 100, "unmeasured calls per worker before timing");
+ABSL_FLAG(uint32_t, connections, 1, "number of connections (grpc channels)");
+ABSL_FLAG(uint32_t, outstanding, 1, "concurrent calls per connection");
+ABSL_FLAG(std::string, mode, "closed", "closed: back-to-back calls | open: fixed offered load");
+ABSL_FLAG(double, qps, 1000, "open mode: total offered load in calls per second");
+ABSL_FLAG(std::string, arrival, "constant", "open mode inter-arrival times: constant | poisson");
+
+using grpc::Channel;
+using grpc::ClientAsyncResponseReader;
+using grpc::ClientContext;
+using grpc::CompletionQueue;
+using grpc::Status;
+using helloworld::Greeter;
+using helloworld::HelloReply;
+using helloworld::HelloRequest;
+
+// One request/response exchange per Call(). Implementations are used by a
+// single thread only.
+class Transport {
+ public:
+  virtual ~Transport() {}
+  // Open the connection. Returns false if the peer is unreachable.
+  virtual bool Connect() = 0;
+  // Send `payload` and wait for the complete reply.
+  virtual bool Call(const std::string& payload) = 0;
+};
+
+// Channels for --connections. Channels created with identical arguments share
+// one subchannel (and TCP connection) through the global subchannel pool, so
+// each one gets a local pool to force a connection of its own.
+std::shared_ptr<Channel> SharedChannel(const std::string& target, uint32_t connection) {
+  static std::mutex mu;
+  static std::map<uint32_t, std::shared_ptr<Channel>> channels;
+  std::lock_guard<std::mutex> lock(mu);
+  auto& channel = channels[connection];
+  if (!channel) {
+    grpc::ChannelArguments args;
+    args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+    channel = grpc::CreateCustomChannel(target, grpc::InsecureChannelCredentials(), args);
+  }
+  return channel;
+}
+
+class GrpcTransport : public Transport {
+ public:
+  GrpcTransport(const std::string& target, uint32_t connection)
+      : target_(target), connection_(connection) {}
+
+  bool Connect() override {
+    channel_ = SharedChannel(target_, connection_);
+    stub_ = Greeter::NewStub(channel_);
+    return channel_->WaitForConnected(std::chrono::system_clock::now() +
+                                      std::chrono::seconds(5));
+  }
+
+  bool Call(const std::string& payload) override {
+    HelloRequest request;
+    request.set_name(payload);
+    HelloReply reply;
+    ClientContext context;
+    return stub_->SayHello(&context, request, &reply).ok();
+  }
+
+ protected:
+  std::string target_;
+  uint32_t connection_;
+  std::shared_ptr<Channel> channel_;
+  std::unique_ptr<Greeter::Stub> stub_;
+};
+
+class GrpcAsyncTransport : public GrpcTransport {
+ public:
+  using GrpcTransport::GrpcTransport;
+
+  bool Call(const std::string& payload) override {
+    HelloRequest request;
+    request.set_name(payload);
+    HelloReply reply;
+    ClientContext context;
+    Status status;
+    std::unique_ptr<ClientAsyncResponseReader<HelloReply>> rpc(
+        stub_->AsyncSayHello(&context, request, &cq_));
+    rpc->Finish(&reply, &status, (void*)1);
+    void* got_tag;
+    bool ok = false;
+    GPR_ASSERT(cq_.Next(&got_tag, &ok));
+    GPR_ASSERT(got_tag == (void*)1);
+    return ok && status.ok();
+  }
+
+ private:
+  CompletionQueue cq_;
+};
+
+// Talks to profile/socket/server: the server reads exactly `length` bytes and
+// answers with kSocketReply.
+class SocketTransport : public Transport {
+ public:
+  static constexpr char kSocketReply[] = "Hello from server";
+
+  explicit SocketTransport(const std::string& target) : target_(target) {}
+  ~SocketTransport() override {
+    if (sock_ >= 0) {
+      close(sock_);
+    }
+  }
+
+  bool Connect() override {
+    auto colon = target_.rfind(':');
+    std::string host = target_.substr(0, colon);
+    std::string port = target_.substr(colon + 1);
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int status = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+    if (status != 0) {
+      std::cerr << "getaddrinfo error: " << gai_strerror(status) << std::endl;
+      return false;
+    }
+    sock_ = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    bool connected = false;
+    if (sock_ >= 0) {
+      // gRPC and httplib disable Nagle too; keep the comparison fair.
+      int opt = 1;
+      setsockopt(sock_, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+      connected = connect(sock_, res->ai_addr, res->ai_addrlen) == 0;
+      if (!connected) {
+        close(sock_);
+        sock_ = -1;
+      }
+    }
+    freeaddrinfo(res);
+    return connected;
+  }
+
+  bool Call(const std::string& payload) override {
+    size_t sent = 0;
+    while (sent < payload.size()) {
+      ssize_t n = send(sock_, payload.data() + sent, payload.size() - sent, 0);
+      if (n <= 0) {
+        return false;
+      }
+      sent += n;
+    }
+    char buffer[sizeof(kSocketReply)];
+    size_t received = 0;
+    while (received < sizeof(kSocketReply) - 1) {
+      ssize_t n = read(sock_, buffer + received, sizeof(kSocketReply) - 1 - received);
+      if (n <= 0) {
+        return false;
+      }
+      received += n;
+    }
+    return true;
+  }
+
+ private:
+  std::string target_;
+  int sock_ = -1;
+};
+
+class HttpTransport : public Transport {
+ public:
+  explicit HttpTransport(const std::string& target) {
+    auto colon = target.rfind(':');
+    client_.reset(new httplib::Client(target.substr(0, colon),
+                                      std::stoi(target.substr(colon + 1))));
+    client_->set_keep_alive(true);
+    client_->set_tcp_nodelay(true);
+  }
+
+  bool Connect() override { return Call(""); }
+
+  bool Call(const std::string& payload) override {
+    auto res = client_->Post("/hello", payload, "application/octet-stream");
+    return res && res->status == 200;
+  }
+
+ private:
+  std::unique_ptr<httplib::Client> client_;
+};
+
+// Builds the transport of one worker; `connection` is the index of the
+// connection the worker belongs to.
+typedef std::function<std::unique_ptr<Transport>(const std::string&, uint32_t)> TransportFactory;
+
+const std::map<std::string, TransportFactory>& Transports() {
+  static const std::map<std::string, TransportFactory> transports = {
+      {"grpc",
+       [](const std::string& t, uint32_t c) { return std::unique_ptr<Transport>(new GrpcTransport(t, c)); }},
+      {"grpc_async",
+       [](const std::string& t, uint32_t c) { return std::unique_ptr<Transport>(new GrpcAsyncTransport(t, c)); }},
+      {"socket", [](const std::string& t, uint32_t) { return std::unique_ptr<Transport>(new SocketTransport(t)); }},
+      {"http", [](const std::string& t, uint32_t) { return std::unique_ptr<Transport>(new HttpTransport(t)); }},
+  };
+  return transports;
+}
+
+struct LoadSpec {
+  uint32_t warmup;
+  uint32_t loop;
+  bool open_loop;
+  bool poisson;
+  double worker_qps;  // open loop only: offered load of a single worker
+  uint32_t workers;
+};
+
+struct WorkerResult {
+  histogram latency;
+  uint64_t failed = 0;
+};
+
+// Workers connect and warm up on their own, then all start the measured
+// phase together so the wall time only covers measured calls.
+std::atomic<uint32_t> workers_ready{0};
+std::atomic<bool> workers_go{false};
+
+void RunWorker(const TransportFactory& factory, const std::string& target, uint32_t connection,
+               const std::string& payload, const LoadSpec& load, uint32_t index, WorkerResult* result) {
+  std::unique_ptr<Transport> transport = factory(target, connection);
+  bool connected = transport->Connect();
+  if (!connected) {
+    std::cerr << "connect to " << target << " failed" << std::endl;
+    result->failed = load.loop;
+  }
+  for (uint32_t i = 0; connected && i < load.warmup; ++i) {
+    transport->Call(payload);
+  }
+  workers_ready++;
+  while (!workers_go) {
+    std::this_thread::yield();
+  }
+  if (!connected) {
+    return;
+  }
+
+  typedef std::chrono::steady_clock clock;
+  std::mt19937_64 rng(index + 1);
+  std::exponential_distribution<double> exponential(load.worker_qps);
+  const std::chrono::duration<double> constant_gap(load.open_loop ? 1.0 / load.worker_qps : 0);
+  auto intended = clock::now();
+  if (load.open_loop && !load.poisson) {
+    // Stagger the workers by 1/qps so their sends interleave evenly instead
+    // of all going out together every 1/worker_qps.
+    intended += std::chrono::duration_cast<clock::duration>(constant_gap * index / load.workers);
+  }
+  for (uint32_t i = 0; i < load.loop; ++i) {
+    if (load.open_loop) {
+      // Sleep until the scheduled send time. If we are already behind the
+      // schedule the call goes out immediately and the lag is charged to it.
+      std::this_thread::sleep_until(intended);
+    } else {
+      intended = clock::now();
+    }
+    bool ok = transport->Call(payload);
+    auto e = clock::now();
+    if (ok) {
+      result->latency.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(e - intended).count());
+    } else {
+      result->failed++;
+    }
+    if (load.open_loop) {
+      auto gap = load.poisson ? std::chrono::duration<double>(exponential(rng)) : constant_gap;
+      intended += std::chrono::duration_cast<clock::duration>(gap);
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  std::string name = absl::GetFlag(FLAGS_transport);
+  auto it = Transports().find(name);
+  if (it == Transports().end()) {
+    std::cerr << "unknown --transport=" << name << std::endl;
+    return 1;
+  }
+  std::string target = absl::GetFlag(FLAGS_target);
+  std::string payload(absl::GetFlag(FLAGS_length), 'a');
+  uint32_t connections = std::max(1u, absl::GetFlag(FLAGS_connections));
+  uint32_t outstanding = std::max(1u, absl::GetFlag(FLAGS_outstanding));
+  uint32_t threads = connections * outstanding;
+  std::string mode = absl::GetFlag(FLAGS_mode);
+  std::string arrival = absl::GetFlag(FLAGS_arrival);
+  if ((mode != "closed" && mode != "open") || (arrival != "constant" && arrival != "poisson")) {
+    std::cerr << "unknown --mode=" << mode << " or --arrival=" << arrival << std::endl;
+    return 1;
+  }
+  LoadSpec load;
+  load.warmup = absl::GetFlag(FLAGS_warmup);
+  load.loop = absl::GetFlag(FLAGS_loop);
+  load.open_loop = mode == "open";
+  load.poisson = arrival == "poisson";
+  load.worker_qps = std::max(1e-3, absl::GetFlag(FLAGS_qps)) / threads;
+  load.workers = threads;
+
+  std::vector<WorkerResult> results(threads);
+  std::vector<std::thread> workers;
+  for (uint32_t i = 0; i < threads; ++i) {
+    workers.emplace_back(RunWorker, std::cref(it->second), std::cref(target), i % connections, std::cref(payload),
+                         std::cref(load), i, &results[i]);
+  }
+  while (workers_ready < threads) {
+    std::this_thread::yield();
+  }
+  auto s = std::chrono::steady_clock::now();
+  workers_go = true;
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  auto e = std::chrono::steady_clock::now();
+
+  histogram total;
+  uint64_t failed = 0;
+  for (auto& result : results) {
+    total.Merge(result.latency);
+    failed += result.failed;
+  }
+  double seconds = std::chrono::duration<double>(e - s).count();
+  double rps = total.Count() / seconds;
+  std::cout << "transport:" << name << " mode:" << mode << " connections:" << connections
+            << " outstanding:" << outstanding << " loop:" << load.loop << " payload:" << payload.size()
+            << "B failed:" << failed << std::endl;
+  if (load.open_loop) {
+    std::cout << "offered: " << load.worker_qps * threads << " req/s (" << arrival << ")" << std::endl;
+  }
+  std::cout << "throughput: " << rps << " req/s " << rps * payload.size() / 1024 / 1024 << " MB/s" << std::endl;
+  std::cout << "latency: ";
+  total.Print(std::cout);
+  std::cout << std::endl;
+  return failed ? 1 : 0;
+}
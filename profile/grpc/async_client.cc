@@ -1,13 +1,23 @@
+#include <pthread.h>
+#include <sched.h>
+
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <string>
-#include <chrono>
+#include <thread>
+#include <vector>
 
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 
+#include <grpc/support/log.h>
 #include <grpcpp/grpcpp.h>
 
+#include "profile/histogram.h"
+
 #ifdef BAZEL_BUILD
 #include "examples/protos/helloworld.grpc.pb.h"
 #else
@@ -15,121 +25,227 @@
 #endif
 
 ABSL_FLAG(std::string, target, "localhost:50051", "Server address");
-ABSL_FLAG(uint32_t, loop, 1000, "client call loop times");
+ABSL_FLAG(uint32_t, loop, 100000, "total number of calls");
+ABSL_FLAG(uint32_t, length, 25000, "request payload size in bytes");
+ABSL_FLAG(uint32_t, window, 64, "calls kept in flight in total");
+ABSL_FLAG(uint32_t, channels, 1, "channels, each with its own connection and completion queue");
+ABSL_FLAG(uint32_t, pollers, 1, "threads draining each completion queue");
+ABSL_FLAG(std::string, balance, "round_robin", "channel for the next call: round_robin | least_outstanding");
+ABSL_FLAG(bool, pin, true, "pin every poller thread to its own core");
 
 using grpc::Channel;
+using grpc::ClientAsyncResponseReader;
 using grpc::ClientContext;
+using grpc::CompletionQueue;
 using grpc::Status;
 using helloworld::Greeter;
 using helloworld::HelloReply;
 using helloworld::HelloRequest;
 
+// Pipelined client: keeps `window` SayHello calls outstanding, spread over
+// `channels` channels. Every finished call immediately starts the next one
+// from the poller thread that reaped it, so the channels never drain.
+//
+// A single HTTP/2 connection is served by one transport thread on each side,
+// so one channel caps out long before the NIC does. Each channel here has
+// its own TCP connection, its own CompletionQueue and its own (pinned)
+// poller threads, i.e. a shard that shares nothing with the others.
 class GreeterClient {
-public:
-  GreeterClient(std::shared_ptr<Channel> channel)
-      : stub_(Greeter::NewStub(channel)) {}
+ public:
+  GreeterClient(const std::vector<std::shared_ptr<Channel>>& channels, const std::string& user,
+                bool least_outstanding)
+      : least_outstanding_(least_outstanding) {
+    for (auto& channel : channels) {
+      shards_.emplace_back(new Shard);
+      shards_.back()->stub = Greeter::NewStub(channel);
+    }
+    request_.set_name(user);
+  }
 
-  // Assembles the client's payload, sends it and presents the response back
-  // from the server.
-  std::string SayHello(const std::string& user) {
-    // Data we are sending to the server.
-    HelloRequest request;
-    request.set_name(user);
+  // Runs `loop` calls with `window` in flight, returns the merged latency.
+  histogram Run(uint32_t loop, uint32_t window, uint32_t pollers, bool pin) {
+    loop_ = loop;
+    std::vector<histogram> latencies(shards_.size() * pollers);
+    std::vector<std::thread> threads;
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < latencies.size(); ++i) {
+      Shard* shard = shards_[i / pollers].get();
+      threads.emplace_back(&GreeterClient::AsyncCompleteRpc, this, shard, &latencies[i]);
+      if (pin) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(i % cores, &cpuset);
+        pthread_setaffinity_np(threads.back().native_handle(), sizeof(cpu_set_t), &cpuset);
+      }
+    }
+    // The call objects are reused for the whole run: one per window slot.
+    window_ = window;
+    calls_.reset(new AsyncClientCall[window]);
+    for (uint32_t i = 0; i < window; ++i) {
+      if (!StartCall(&calls_[i])) {
+        SlotDone();
+      }
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    histogram total;
+    for (auto& latency : latencies) {
+      total.Merge(latency);
+    }
+    return total;
+  }
+
+  uint64_t failed() const { return failed_; }
 
+ private:
+  struct Shard {
+    std::unique_ptr<Greeter::Stub> stub;
+    CompletionQueue cq;
+    std::atomic<uint32_t> outstanding{0};
+  };
+
+  // struct for keeping state and data information
+  struct AsyncClientCall {
     // Container for the data we expect from the server.
     HelloReply reply;
 
-    // Context for the client. It could be used to convey extra information to
-    // the server and/or tweak certain RPC behaviors.
-    ClientContext context;
+    // ClientContext cannot be reused across RPCs, it is re-created in place
+    // for every call so the slot itself needs no allocation.
+    std::optional<ClientContext> context;
+
+    // Storage for the status of the RPC upon completion.
+    Status status;
+
+    std::unique_ptr<ClientAsyncResponseReader<HelloReply>> response_reader;
 
-    // The actual RPC.
-    Status status = stub_->SayHello(&context, request, &reply);
+    std::chrono::steady_clock::time_point start;
 
-    // Act upon its status.
-    if (status.ok()) {
-      return reply.message();
-    } else {
-      std::cout << status.error_code() << ": " << status.error_message()
-                << std::endl;
-      return "RPC failed";
+    // The channel the current call runs on.
+    Shard* shard = nullptr;
+  };
+
+  Shard* PickShard() {
+    size_t first = next_shard_.fetch_add(1) % shards_.size();
+    if (!least_outstanding_) {
+      return shards_[first].get();
+    }
+    // Start the scan at the round robin position so ties do not always land
+    // on the first channel.
+    Shard* best = shards_[first].get();
+    for (size_t i = 1; i < shards_.size(); ++i) {
+      Shard* shard = shards_[(first + i) % shards_.size()].get();
+      if (shard->outstanding < best->outstanding) {
+        best = shard;
+      }
     }
+    return best;
   }
 
-  void SayHelloAsync(const std::string& user, std::function<void(std::string)> callback) {
-    // Data we are sending to the server.
-    HelloRequest request;
-    request.set_name(user);
-
-    // Container for the data we expect from the server.
-    HelloReply reply;
+  // Starts the next call on `call` if the run still needs one. Returns false
+  // once all `loop` calls have been issued.
+  bool StartCall(AsyncClientCall* call) {
+    if (issued_.fetch_add(1) >= loop_) {
+      return false;
+    }
+    call->shard = PickShard();
+    call->shard->outstanding++;
+    // The previous reader lives in the previous call's arena, which goes
+    // with its ClientContext: destroy the reader first.
+    call->response_reader.reset();
+    call->context.emplace();
+    call->start = std::chrono::steady_clock::now();
+    call->response_reader =
+        call->shard->stub->PrepareAsyncSayHello(&*call->context, request_, &call->shard->cq);
+    call->response_reader->StartCall();
+    call->response_reader->Finish(&call->reply, &call->status, (void*)call);
+    return true;
+  }
 
-    // Context for the client. It could be used to convey extra information to
-    // the server and/or tweak certain RPC behaviors.
-    ClientContext context;
-
-    // The actual RPC.
-    std::unique_ptr<grpc::ClientAsyncResponseReader<HelloReply>> rpc(
-        stub_->PrepareAsyncSayHello(&context, request, &cq_));
-    
-    rpc->StartCall();
-    rpc->Finish(&reply, &status_, (void*)1);
-    
+  // Loop while listening for completed responses and refill the window.
+  void AsyncCompleteRpc(Shard* shard, histogram* latency) {
     void* got_tag;
     bool ok = false;
+    while (shard->cq.Next(&got_tag, &ok)) {
+      AsyncClientCall* call = static_cast<AsyncClientCall*>(got_tag);
+      GPR_ASSERT(ok);
+      call->shard->outstanding--;
+      if (call->status.ok()) {
+        latency->Record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - call->start)
+                            .count());
+      } else {
+        failed_++;
+      }
+      if (!StartCall(call)) {
+        SlotDone();
+      }
+    }
+  }
 
-    GPR_ASSERT(cq_.Next(&got_tag, &ok));
-    std::cout<<"client in call"<<std::endl;
-    if (status_.ok()) {
-      callback(reply.message());
-    } else {
-      std::cout << status_.error_code() << ": " << status_.error_message()
-                << std::endl;
-      callback("RPC failed");
+  // A window slot has no more calls to run. The last one lets every poller
+  // leave Next().
+  void SlotDone() {
+    if (++completed_slots_ == window_) {
+      for (auto& shard : shards_) {
+        shard->cq.Shutdown();
+      }
     }
   }
-  grpc::CompletionQueue cq_;
-private:
-  std::unique_ptr<Greeter::Stub> stub_;
-  
-  grpc::Status status_;
+
+  std::vector<std::unique_ptr<Shard>> shards_;
+  bool least_outstanding_;
+  std::atomic<size_t> next_shard_{0};
+  // Every call sends the same payload; it is serialized when the call starts
+  // so a single message can be shared by all of them.
+  HelloRequest request_;
+  std::unique_ptr<AsyncClientCall[]> calls_;
+  uint32_t window_ = 0;
+  uint32_t loop_ = 0;
+  std::atomic<uint32_t> issued_{0};
+  std::atomic<uint32_t> completed_slots_{0};
+  std::atomic<uint64_t> failed_{0};
 };
 
 int main(int argc, char** argv) {
   absl::ParseCommandLine(argc, argv);
-  // Instantiate the client. It requires a channel, out of which the actual RPCs
-  // are created. This channel models a connection to an endpoint specified by
-  // the argument "--target=" which is the only expected argument.
   std::string target_str = absl::GetFlag(FLAGS_target);
-  // We indicate that the channel isn't authenticated (use of
-  // InsecureChannelCredentials()).
-  GreeterClient greeter(
-      grpc::CreateChannel(target_str, grpc::InsecureChannelCredentials()));
-  
-  int length=25000;
-  std::string send_data(length, 'a');
-  auto s= std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch())
-  .count();
   auto loop = absl::GetFlag(FLAGS_loop);
-  std::string user(send_data);
-  for(int i=0;i<loop;++i){
-    std::cout<<"client call SayHelloAsync"<<std::endl;
-    greeter.SayHelloAsync(user, [i](std::string reply) {
-      std::cout << "Greeter received: " << reply << " for loop " << i << std::endl;
-    });
+  auto window = std::max(1u, absl::GetFlag(FLAGS_window));
+  auto channels = std::max(1u, absl::GetFlag(FLAGS_channels));
+  auto pollers = std::max(1u, absl::GetFlag(FLAGS_pollers));
+  auto balance = absl::GetFlag(FLAGS_balance);
+  if (balance != "round_robin" && balance != "least_outstanding") {
+    std::cout << "unknown --balance=" << balance << std::endl;
+    return 1;
   }
-  auto e= std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch())
-  .count();
-  std::cout<<"loop:"<<loop <<" grpc time consume:"<<e-s<<"us"<<std::endl;
-
-  // Run the event loop
-  for (int i = 0; i < loop; ++i) {
-    void* got_tag;
-    bool ok = false;
-    GPR_ASSERT(greeter.cq_.Next(&got_tag, &ok));
-    GPR_ASSERT(ok);
-    GPR_ASSERT(got_tag == (void*)1);
+  std::string user(absl::GetFlag(FLAGS_length), 'a');
+
+  std::vector<std::shared_ptr<Channel>> shards;
+  for (uint32_t i = 0; i < channels; ++i) {
+    // Channels with equal arguments share subchannels through the global
+    // pool and would end up on the same TCP connection.
+    grpc::ChannelArguments args;
+    args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+    auto channel = grpc::CreateCustomChannel(target_str, grpc::InsecureChannelCredentials(), args);
+    if (!channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(5))) {
+      std::cout << "connect to " << target_str << " failed" << std::endl;
+      return 1;
+    }
+    shards.push_back(channel);
   }
-
+  GreeterClient greeter(shards, user, balance == "least_outstanding");
+
+  auto s = std::chrono::steady_clock::now();
+  histogram latency = greeter.Run(loop, window, pollers, absl::GetFlag(FLAGS_pin));
+  auto e = std::chrono::steady_clock::now();
+
+  double seconds = std::chrono::duration<double>(e - s).count();
+  std::cout << "loop:" << loop << " window:" << window << " channels:" << channels << " pollers:" << pollers
+            << " balance:" << balance << " failed:" << greeter.failed() << std::endl;
+  std::cout << "achieved: " << latency.Count() / seconds << " req/s" << std::endl;
+  std::cout << "latency: ";
+  latency.Print(std::cout);
+  std::cout << std::endl;
   return 0;
 }
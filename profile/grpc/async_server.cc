@@ -1,6 +1,11 @@
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
@@ -25,6 +30,8 @@ using helloworld::HelloReply;
 using helloworld::HelloRequest;
 
 ABSL_FLAG(uint16_t, port, 50051, "Server port for the service");
+ABSL_FLAG(bool, pool_calldata, true, "reuse finished CallData objects instead of new/delete per RPC");
+ABSL_FLAG(uint32_t, stats_interval, 0, "seconds between CallData allocation reports, 0 disables them");
 
 class GreeterServiceImpl final : public Greeter::Service {
 public:
@@ -37,43 +44,109 @@ public:
 
 class AsyncGreeterServiceImpl final : public Greeter::AsyncService {
 public:
+  class CallData;
+
+  // Free list of finished CallData objects for one completion queue, only
+  // touched by the thread draining that queue.
+  class CallDataPool {
+  public:
+    CallDataPool(Greeter::AsyncService* service, grpc::ServerCompletionQueue* cq, bool enabled)
+        : service_(service), cq_(cq), enabled_(enabled) {}
+    ~CallDataPool();
+
+    void Spawn();
+    void Release(CallData* call);
+
+    static std::atomic<uint64_t> allocated;
+    static std::atomic<uint64_t> reused;
+
+  private:
+    Greeter::AsyncService* service_;
+    grpc::ServerCompletionQueue* cq_;
+    bool enabled_;
+    std::vector<CallData*> free_;
+  };
+
   class CallData {
   public:
-    CallData(Greeter::AsyncService* service, grpc::ServerCompletionQueue* cq)
-        : service_(service), cq_(cq), responder_(&ctx_), status_(CREATE) {
+    CallData(Greeter::AsyncService* service, grpc::ServerCompletionQueue* cq, CallDataPool* pool)
+        : service_(service), cq_(cq), pool_(pool) {
+      Start();
+    }
+
+    // ServerContext and responder are single use and rebuilt in place, the
+    // messages are cleared and keep their buffers.
+    void Start() {
+      // The old responder refers to the old context: destroy it first.
+      responder_.reset();
+      ctx_.emplace();
+      responder_.emplace(&*ctx_);
+      request_.Clear();
+      response_.Clear();
+      status_ = CREATE;
       Proceed();
     }
 
     void Proceed() {
       if (status_ == CREATE) {
         status_ = PROCESS;
-        service_->RequestSayHello(&ctx_, &request_, &responder_, cq_, cq_,
+        service_->RequestSayHello(&*ctx_, &request_, &*responder_, cq_, cq_,
                                   this);
       } else if (status_ == PROCESS) {
-        new CallData(service_, cq_);
+        pool_->Spawn();
         std::string prefix("Hello ");
         response_.set_message(prefix + request_.name());
 
         status_ = FINISH;
-        responder_.Finish(response_, grpc::Status::OK, this);
+        responder_->Finish(response_, grpc::Status::OK, this);
       } else {
         GPR_ASSERT(status_ == FINISH);
-        delete this;
+        pool_->Release(this);
       }
     }
 
   private:
     Greeter::AsyncService* service_;
     grpc::ServerCompletionQueue* cq_;
-    grpc::ServerContext ctx_;
+    CallDataPool* pool_;
+    std::optional<grpc::ServerContext> ctx_;
     HelloRequest request_;
     HelloReply response_;
-    grpc::ServerAsyncResponseWriter<HelloReply> responder_;
+    std::optional<grpc::ServerAsyncResponseWriter<HelloReply>> responder_;
     enum CallStatus { CREATE, PROCESS, FINISH };
     CallStatus status_;
   };
 };
 
+std::atomic<uint64_t> AsyncGreeterServiceImpl::CallDataPool::allocated{0};
+std::atomic<uint64_t> AsyncGreeterServiceImpl::CallDataPool::reused{0};
+
+AsyncGreeterServiceImpl::CallDataPool::~CallDataPool() {
+  for (CallData* call : free_) {
+    delete call;
+  }
+}
+
+void AsyncGreeterServiceImpl::CallDataPool::Spawn() {
+  if (free_.empty()) {
+    allocated++;
+    new CallData(service_, cq_, this);
+    return;
+  }
+  reused++;
+  CallData* call = free_.back();
+  free_.pop_back();
+  call->Start();
+}
+
+void AsyncGreeterServiceImpl::CallDataPool::Release(CallData* call) {
+  if (enabled_) {
+    free_.push_back(call);
+  } else {
+    delete call;
+  }
+}
+
 void RunServer(uint16_t port) {
   std::string server_address = absl::StrFormat("0.0.0.0:%d", port);
 
@@ -90,10 +163,30 @@ void RunServer(uint16_t port) {
 
   // Register asynchronous service
   builder.RegisterService(&async_service);
+  std::unique_ptr<grpc::ServerCompletionQueue> cq = builder.AddCompletionQueue();
 
   std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
   std::cout << "Server listening on " << server_address << std::endl;
-  server->Wait();
+
+  uint32_t stats_interval = absl::GetFlag(FLAGS_stats_interval);
+  if (stats_interval > 0) {
+    std::thread([stats_interval] {
+      while (true) {
+        std::this_thread::sleep_for(std::chrono::seconds(stats_interval));
+        std::cout << "calldata allocated:" << AsyncGreeterServiceImpl::CallDataPool::allocated
+                  << " reused:" << AsyncGreeterServiceImpl::CallDataPool::reused << std::endl;
+      }
+    }).detach();
+  }
+
+  AsyncGreeterServiceImpl::CallDataPool pool(&async_service, cq.get(), absl::GetFlag(FLAGS_pool_calldata));
+  pool.Spawn();
+  void* tag;
+  bool ok;
+  while (cq->Next(&tag, &ok)) {
+    GPR_ASSERT(ok);
+    static_cast<AsyncGreeterServiceImpl::CallData*>(tag)->Proceed();
+  }
 }
 
 int main(int argc, char** argv) {
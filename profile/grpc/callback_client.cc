@@ -0,0 +1,212 @@
+/*
+ *
+ * Copyright 2015 gRPC authors.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+
+#include <grpcpp/grpcpp.h>
+
+#include "profile/histogram.h"
+
+#ifdef BAZEL_BUILD
+#include "examples/protos/helloworld.grpc.pb.h"
+#else
+#include "helloworld.grpc.pb.h"
+#endif
+
+ABSL_FLAG(std::string, target, "localhost:50051", "Server address");
+ABSL_FLAG(uint32_t, loop, 100000, "total number of calls");
+ABSL_FLAG(uint32_t, length, 25000, "request payload size in bytes");
+ABSL_FLAG(uint32_t, window, 64, "calls kept in flight");
+ABSL_FLAG(std::string, rpc, "unary", "unary: SayHello | stream: SayHelloStreamReply");
+
+using grpc::Channel;
+using grpc::ClientContext;
+using grpc::Status;
+using helloworld::Greeter;
+using helloworld::HelloReply;
+using helloworld::HelloRequest;
+
+// Callback API counterpart of async_client.cc: `window` calls are kept in
+// flight, each finished call starts the next one from its OnDone(). There are
+// no client threads at all, reactions run on the gRPC library's threads.
+class GreeterClient {
+ public:
+  GreeterClient(std::shared_ptr<Channel> channel, const std::string& user)
+      : stub_(Greeter::NewStub(channel)) {
+    request_.set_name(user);
+  }
+
+  histogram Run(uint32_t loop, uint32_t window, bool stream) {
+    loop_ = loop;
+    stream_ = stream;
+    slots_.resize(window);
+    for (auto& slot : slots_) {
+      if (!StartCall(&slot)) {
+        SlotDone();
+      }
+    }
+    std::unique_lock<std::mutex> lock(mu_);
+    cv_.wait(lock, [this] { return done_slots_ == slots_.size(); });
+    histogram total;
+    for (auto& slot : slots_) {
+      total.Merge(slot.latency);
+    }
+    return total;
+  }
+
+  uint64_t failed() const { return failed_; }
+
+ private:
+  // One window position. Only one call runs on a slot at a time, so its
+  // histogram needs no locking.
+  struct Slot {
+    histogram latency;
+  };
+
+  class UnaryCall : public grpc::ClientUnaryReactor {
+   public:
+    UnaryCall(GreeterClient* client, Slot* slot) : client_(client), slot_(slot) {
+      client_->stub_->async()->SayHello(&context_, &client_->request_, &reply_, this);
+      StartCall();
+    }
+
+    void OnDone(const Status& status) override {
+      client_->CallDone(slot_, start_, status);
+      delete this;
+    }
+
+   private:
+    GreeterClient* client_;
+    Slot* slot_;
+    ClientContext context_;
+    HelloReply reply_;
+    std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
+  };
+
+  class StreamCall : public grpc::ClientReadReactor<HelloReply> {
+   public:
+    StreamCall(GreeterClient* client, Slot* slot) : client_(client), slot_(slot) {
+      client_->stub_->async()->SayHelloStreamReply(&context_, &client_->request_, this);
+      StartRead(&reply_);
+      StartCall();
+    }
+
+    void OnReadDone(bool ok) override {
+      if (ok) {
+        StartRead(&reply_);
+      }
+    }
+
+    void OnDone(const Status& status) override {
+      client_->CallDone(slot_, start_, status);
+      delete this;
+    }
+
+   private:
+    GreeterClient* client_;
+    Slot* slot_;
+    ClientContext context_;
+    HelloReply reply_;
+    std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
+  };
+
+  bool StartCall(Slot* slot) {
+    if (issued_.fetch_add(1) >= loop_) {
+      return false;
+    }
+    if (stream_) {
+      new StreamCall(this, slot);
+    } else {
+      new UnaryCall(this, slot);
+    }
+    return true;
+  }
+
+  void CallDone(Slot* slot, std::chrono::steady_clock::time_point start, const Status& status) {
+    if (status.ok()) {
+      slot->latency.Record(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    } else {
+      failed_++;
+    }
+    if (!StartCall(slot)) {
+      SlotDone();
+    }
+  }
+
+  void SlotDone() {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (++done_slots_ == slots_.size()) {
+      cv_.notify_one();
+    }
+  }
+
+  std::unique_ptr<Greeter::Stub> stub_;
+  HelloRequest request_;
+  std::vector<Slot> slots_;
+  uint32_t loop_ = 0;
+  bool stream_ = false;
+  std::atomic<uint32_t> issued_{0};
+  std::atomic<uint64_t> failed_{0};
+  std::mutex mu_;
+  std::condition_variable cv_;
+  size_t done_slots_ = 0;
+};
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  std::string target_str = absl::GetFlag(FLAGS_target);
+  auto loop = absl::GetFlag(FLAGS_loop);
+  auto window = std::max(1u, absl::GetFlag(FLAGS_window));
+  auto rpc = absl::GetFlag(FLAGS_rpc);
+  if (rpc != "unary" && rpc != "stream") {
+    std::cout << "unknown --rpc=" << rpc << std::endl;
+    return 1;
+  }
+  std::string user(absl::GetFlag(FLAGS_length), 'a');
+
+  auto channel = grpc::CreateChannel(target_str, grpc::InsecureChannelCredentials());
+  if (!channel->WaitForConnected(std::chrono::system_clock::now() + std::chrono::seconds(5))) {
+    std::cout << "connect to " << target_str << " failed" << std::endl;
+    return 1;
+  }
+  GreeterClient greeter(channel, user);
+
+  auto s = std::chrono::steady_clock::now();
+  histogram latency = greeter.Run(loop, window, rpc == "stream");
+  auto e = std::chrono::steady_clock::now();
+
+  double seconds = std::chrono::duration<double>(e - s).count();
+  std::cout << "rpc:" << rpc << " loop:" << loop << " window:" << window << " failed:" << greeter.failed()
+            << std::endl;
+  std::cout << "achieved: " << latency.Count() / seconds << " req/s" << std::endl;
+  std::cout << "latency: ";
+  latency.Print(std::cout);
+  std::cout << std::endl;
+  return 0;
+}
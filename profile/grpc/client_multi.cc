@@ -20,6 +20,7 @@
 #include <memory>
 #include <string>
 #include <chrono>
+#include <vector>
 
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
@@ -34,6 +35,7 @@
 
 ABSL_FLAG(std::string, target, "localhost:50051", "Server address");
 ABSL_FLAG(uint32_t, loop, 1000, "client call loop times");
+ABSL_FLAG(bool, work_stealing, true, "spread calls over the 5 threads by work stealing instead of pinning call i to thread i%5");
 
 using grpc::Channel;
 using grpc::ClientContext;
@@ -95,14 +97,16 @@ int main(int argc, char** argv) {
   .count();
   auto loop = absl::GetFlag(FLAGS_loop);
   std::string user(send_data);
-  thread_pool pool(5);
-
-  for (int i=0;i<loop;++i){
-        pool.push_task([user,&greeter]{
-          std::string reply = greeter.SayHello(user);
-      },i%5);
-  }
-  pool.wait_for_tasks();
+  bool work_stealing = absl::GetFlag(FLAGS_work_stealing);
+  thread_pool pool(5, work_stealing ? thread_pool::schedule::work_stealing : thread_pool::schedule::pinned);
+
+  auto say_hello = [&user,&greeter]{  // user outlives the pool, no 25 KB copy per task
+    std::string reply = greeter.SayHello(user);
+  };
+  std::vector<decltype(say_hello)> calls(loop, say_hello);
+  task_latch done;
+  pool.push_batch(calls, &done);
+  done.wait();
 
 
   // for(int i=0;i<loop;++i){
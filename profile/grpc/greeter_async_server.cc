@@ -16,10 +16,21 @@
  *
  */
 
+#include <pthread.h>
+#include <sched.h>
+
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <string>
 #include <thread>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/strings/str_format.h"
 
 #include <grpc/support/log.h>
 #include <grpcpp/grpcpp.h>
@@ -40,17 +51,29 @@ using helloworld::Greeter;
 using helloworld::HelloReply;
 using helloworld::HelloRequest;
 
+ABSL_FLAG(uint16_t, port, 50051, "Server port for the service");
+ABSL_FLAG(uint32_t, cqs, 1, "completion queues, each drained by its own thread");
+ABSL_FLAG(uint32_t, prepost, 1, "RequestSayHello calls kept posted on every queue");
+ABSL_FLAG(bool, pin, false, "pin every completion queue thread to its own core");
+ABSL_FLAG(bool, pool_calldata, true, "reuse finished CallData objects instead of new/delete per RPC");
+ABSL_FLAG(uint32_t, stats_interval, 0, "seconds between CallData allocation reports, 0 disables them");
+
 class ServerImpl final {
  public:
+  ServerImpl(uint16_t port, uint32_t cqs, uint32_t prepost, bool pin, bool pool_calldata)
+      : port_(port), cq_count_(cqs), prepost_(prepost), pin_(pin), pool_calldata_(pool_calldata) {}
+
   ~ServerImpl() {
     server_->Shutdown();
     // Always shutdown the completion queue after the server.
-    cq_->Shutdown();
+    for (auto& cq : cqs_) {
+      cq->Shutdown();
+    }
   }
 
   // There is no shutdown handling in this code.
   void Run() {
-    std::string server_address("0.0.0.0:50051");
+    std::string server_address = absl::StrFormat("0.0.0.0:%d", port_);
 
     ServerBuilder builder;
     // Listen on the given address without any authentication mechanism.
@@ -58,27 +81,90 @@ class ServerImpl final {
     // Register "service_" as the instance through which we'll communicate with
     // clients. In this case it corresponds to an *asynchronous* service.
     builder.RegisterService(&service_);
-    // Get hold of the completion queue used for the asynchronous communication
-    // with the gRPC runtime.
-    cq_ = builder.AddCompletionQueue();
+    // Get hold of the completion queues used for the asynchronous
+    // communication with the gRPC runtime. A single queue drained by a single
+    // thread serializes every RPC of the server, so each queue gets a thread
+    // of its own.
+    for (uint32_t i = 0; i < cq_count_; ++i) {
+      cqs_.push_back(builder.AddCompletionQueue());
+    }
     // Finally assemble the server.
     server_ = builder.BuildAndStart();
-    std::cout << "Server listening on " << server_address << std::endl;
+    std::cout << "Server listening on " << server_address << " cqs:" << cq_count_
+              << " prepost:" << prepost_ << std::endl;
 
-    // Proceed to the server's main loop.
-    HandleRpcs();
+    // Proceed to the server's main loop, one per completion queue.
+    std::vector<std::thread> threads;
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    for (uint32_t i = 0; i < cq_count_; ++i) {
+      threads.emplace_back(&ServerImpl::HandleRpcs, this, cqs_[i].get());
+      if (pin_) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(i % cores, &cpuset);
+        pthread_setaffinity_np(threads.back().native_handle(), sizeof(cpu_set_t), &cpuset);
+      }
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+
+  // Prints how many CallData objects were allocated versus reused.
+  static void ReportCallData(uint32_t interval) {
+    while (true) {
+      std::this_thread::sleep_for(std::chrono::seconds(interval));
+      std::cout << "calldata allocated:" << calldata_allocated_ << " reused:" << calldata_reused_ << std::endl;
+    }
   }
 
  private:
+  class CallData;
+
+  // Free list of finished CallData objects. There is one pool per completion
+  // queue and a queue is drained by a single thread, so it needs no lock.
+  class CallDataPool {
+   public:
+    CallDataPool(Greeter::AsyncService* service, ServerCompletionQueue* cq, bool enabled)
+        : service_(service), cq_(cq), enabled_(enabled) {}
+    ~CallDataPool();
+
+    // Arms a CallData for the next SayHello, reusing a finished one if any.
+    void Spawn();
+    // Takes back a CallData that reached FINISH.
+    void Release(CallData* call);
+
+   private:
+    Greeter::AsyncService* service_;
+    ServerCompletionQueue* cq_;
+    bool enabled_;
+    std::vector<CallData*> free_;
+  };
+
   // Class encompasing the state and logic needed to serve a request.
   class CallData {
    public:
     // Take in the "service" instance (in this case representing an asynchronous
     // server) and the completion queue "cq" used for asynchronous communication
     // with the gRPC runtime.
-    CallData(Greeter::AsyncService* service, ServerCompletionQueue* cq)
-        : service_(service), cq_(cq), responder_(&ctx_), status_(CREATE) {
+    CallData(Greeter::AsyncService* service, ServerCompletionQueue* cq, CallDataPool* pool)
+        : service_(service), cq_(cq), pool_(pool) {
       // Invoke the serving logic right away.
+      Start();
+    }
+
+    // (Re)arm this instance for a new RPC. ServerContext and the responder
+    // bound to it are single use, so they are rebuilt in place; the messages
+    // are only cleared and keep their allocated buffers (the 25 KB request
+    // name in particular).
+    void Start() {
+      // The old responder refers to the old context: destroy it first.
+      responder_.reset();
+      ctx_.emplace();
+      responder_.emplace(&*ctx_);
+      request_.Clear();
+      reply_.Clear();
+      status_ = CREATE;
       Proceed();
     }
 
@@ -92,13 +178,13 @@ class ServerImpl final {
         // the tag uniquely identifying the request (so that different CallData
         // instances can serve different requests concurrently), in this case
         // the memory address of this CallData instance.
-        service_->RequestSayHello(&ctx_, &request_, &responder_, cq_, cq_,
+        service_->RequestSayHello(&*ctx_, &request_, &*responder_, cq_, cq_,
                                   this);
       } else if (status_ == PROCESS) {
         // Spawn a new CallData instance to serve new clients while we process
-        // the one for this CallData. The instance will deallocate itself as
-        // part of its FINISH state.
-        new CallData(service_, cq_);
+        // the one for this CallData. The instance will return itself to the
+        // pool as part of its FINISH state.
+        pool_->Spawn();
 
         // The actual processing.
         std::string prefix("Hello ");
@@ -108,11 +194,11 @@ class ServerImpl final {
         // memory address of this instance as the uniquely identifying tag for
         // the event.
         status_ = FINISH;
-        responder_.Finish(reply_, Status::OK, this);
+        responder_->Finish(reply_, Status::OK, this);
       } else {
         GPR_ASSERT(status_ == FINISH);
-        // Once in the FINISH state, deallocate ourselves (CallData).
-        delete this;
+        // Once in the FINISH state, hand ourselves back for reuse.
+        pool_->Release(this);
       }
     }
 
@@ -122,10 +208,12 @@ class ServerImpl final {
     Greeter::AsyncService* service_;
     // The producer-consumer queue where for asynchronous server notifications.
     ServerCompletionQueue* cq_;
+    // Where this instance goes back to once finished.
+    CallDataPool* pool_;
     // Context for the rpc, allowing to tweak aspects of it such as the use
     // of compression, authentication, as well as to send metadata back to the
     // client.
-    ServerContext ctx_;
+    std::optional<ServerContext> ctx_;
 
     // What we get from the client.
     HelloRequest request_;
@@ -133,7 +221,7 @@ class ServerImpl final {
     HelloReply reply_;
 
     // The means to get back to the client.
-    ServerAsyncResponseWriter<HelloReply> responder_;
+    std::optional<ServerAsyncResponseWriter<HelloReply>> responder_;
 
     // Let's implement a tiny state machine with the following states.
     enum CallStatus { CREATE, PROCESS, FINISH };
@@ -141,9 +229,14 @@ class ServerImpl final {
   };
 
   // This can be run in multiple threads if needed.
-  void HandleRpcs() {
-    // Spawn a new CallData instance to serve new clients.
-    new CallData(&service_, cq_.get());
+  void HandleRpcs(ServerCompletionQueue* cq) {
+    CallDataPool pool(&service_, cq, pool_calldata_);
+    // Spawn new CallData instances to serve new clients. Every finished
+    // request posts a replacement, so `prepost_` requests stay armed and a
+    // burst of new calls never waits for this thread to re-post one.
+    for (uint32_t i = 0; i < prepost_; ++i) {
+      pool.Spawn();
+    }
     void* tag;  // uniquely identifies a request.
     bool ok;
     while (true) {
@@ -151,20 +244,63 @@ class ServerImpl final {
       // event is uniquely identified by its tag, which in this case is the
       // memory address of a CallData instance.
       // The return value of Next should always be checked. This return value
-      // tells us whether there is any kind of event or cq_ is shutting down.
-      GPR_ASSERT(cq_->Next(&tag, &ok));
+      // tells us whether there is any kind of event or cq is shutting down.
+      GPR_ASSERT(cq->Next(&tag, &ok));
       GPR_ASSERT(ok);
       static_cast<CallData*>(tag)->Proceed();
     }
   }
 
-  std::unique_ptr<ServerCompletionQueue> cq_;
+  uint16_t port_;
+  uint32_t cq_count_;
+  uint32_t prepost_;
+  bool pin_;
+  bool pool_calldata_;
+  std::vector<std::unique_ptr<ServerCompletionQueue>> cqs_;
   Greeter::AsyncService service_;
   std::unique_ptr<Server> server_;
+
+  static std::atomic<uint64_t> calldata_allocated_;
+  static std::atomic<uint64_t> calldata_reused_;
 };
 
+std::atomic<uint64_t> ServerImpl::calldata_allocated_{0};
+std::atomic<uint64_t> ServerImpl::calldata_reused_{0};
+
+ServerImpl::CallDataPool::~CallDataPool() {
+  for (CallData* call : free_) {
+    delete call;
+  }
+}
+
+void ServerImpl::CallDataPool::Spawn() {
+  if (free_.empty()) {
+    calldata_allocated_++;
+    new CallData(service_, cq_, this);
+    return;
+  }
+  calldata_reused_++;
+  CallData* call = free_.back();
+  free_.pop_back();
+  call->Start();
+}
+
+void ServerImpl::CallDataPool::Release(CallData* call) {
+  if (enabled_) {
+    free_.push_back(call);
+  } else {
+    delete call;
+  }
+}
+
 int main(int argc, char** argv) {
-  ServerImpl server;
+  absl::ParseCommandLine(argc, argv);
+  ServerImpl server(absl::GetFlag(FLAGS_port), std::max(1u, absl::GetFlag(FLAGS_cqs)),
+                    std::max(1u, absl::GetFlag(FLAGS_prepost)), absl::GetFlag(FLAGS_pin),
+                    absl::GetFlag(FLAGS_pool_calldata));
+  if (absl::GetFlag(FLAGS_stats_interval) > 0) {
+    std::thread(&ServerImpl::ReportCallData, absl::GetFlag(FLAGS_stats_interval)).detach();
+  }
   server.Run();
 
   return 0;
@@ -28,21 +28,642 @@
  */
 
 #define THREAD_POOL_VERSION "v2.0.0 (2021-08-14)"
+#include <linux/futex.h>  // FUTEX_WAIT_PRIVATE, FUTEX_WAKE_PRIVATE
+#include <sys/syscall.h>   // SYS_futex
 #include <unistd.h>
-#include <atomic>       // std::atomic
-#include <chrono>       // std::chrono
-#include <cstdint>      // std::int_fast64_t, std::uint_fast32_t
-#include <functional>   // std::function
-#include <future>       // std::future, std::promise
-#include <iostream>     // std::cout, std::ostream
-#include <memory>       // std::shared_ptr, std::unique_ptr
-#include <mutex>        // std::mutex, std::scoped_lock
-#include <queue>        // std::queue
-#include <thread>       // std::this_thread, std::thread
+#include <atomic>              // std::atomic, std::atomic_thread_fence
+#include <chrono>              // std::chrono
+#include <climits>             // INT_MAX
+#include <algorithm>           // std::min
+#include <cstddef>             // std::max_align_t
+#include <cstdint>             // std::int_fast64_t, std::uint_fast32_t, std::uint32_t
+#include <exception>           // std::current_exception
+#include <future>              // std::future, std::promise
+#include <iostream>            // std::cout, std::ostream
+#include <iterator>            // std::begin, std::distance, std::end
+#include <memory>              // std::allocator_arg, std::unique_ptr
+#include <mutex>               // std::mutex, std::scoped_lock
+#include <new>                 // placement new
+#include <thread>              // std::this_thread, std::thread
 #include <type_traits>  // std::common_type_t, std::decay_t, std::enable_if_t, std::is_void_v, std::invoke_result_t
-#include <utility>      // std::move
+#include <utility>      // std::move, std::pair
 #include <vector>
 
+// =============================================================================================
+// //
+//                                   Begin class block_cache //
+
+/**
+ * @brief Per thread free lists of small blocks, so that a block freed by a
+ * task is reused by the next one instead of going back to malloc.
+ * @details Sizes are rounded up to 64 bytes; anything above 256 bytes goes
+ * straight to operator new. Blocks are often allocated by the thread pushing
+ * a task and freed by the one running it, so a list that grows past two
+ * batches of 64 hands a batch to a shared depot, and a thread whose list is
+ * empty takes a batch from there: one lock per 64 blocks instead of a malloc
+ * per block.
+ */
+class block_cache {
+ public:
+  static void *allocate(size_t size) {
+    size_t index = size_class(size);
+    if (index >= classes) {
+      return ::operator new(size);
+    }
+    free_list &list = lists()[index];
+    if (list.head == nullptr && !depot::get().take(index, list)) {
+      return ::operator new((index + 1) * granule);
+    }
+    block *b = list.head;
+    list.head = b->next;
+    list.count--;
+    return b;
+  }
+
+  static void deallocate(void *p, size_t size) {
+    size_t index = size_class(size);
+    if (index >= classes) {
+      ::operator delete(p);
+      return;
+    }
+    free_list &list = lists()[index];
+    list.head = new (p) block{list.head};
+    list.count++;
+    if (list.count >= 2 * batch) {
+      depot::get().give(index, list);
+    }
+  }
+
+ private:
+  static constexpr size_t granule = 64;
+  static constexpr size_t classes = 4;
+  static constexpr size_t batch = 64;
+  static constexpr size_t max_batches = 256;  // per size class in the depot, the rest is freed
+
+  struct block {
+    block *next;
+  };
+
+  static void free_chain(block *head) {
+    while (head != nullptr) {
+      block *next = head->next;
+      ::operator delete(head);
+      head = next;
+    }
+  }
+
+  struct free_list {
+    ~free_list() { free_chain(head); }
+    block *head = nullptr;
+    size_t count = 0;
+  };
+
+  /**
+   * @brief Batches of `batch` blocks shared by all threads. Never destroyed,
+   * a thread may still free blocks while statics are torn down.
+   */
+  class depot {
+   public:
+    static depot &get() {
+      static depot *shared = new depot();
+      return *shared;
+    }
+
+    // Moves `batch` blocks from the front of `list` here.
+    void give(size_t index, free_list &list) {
+      block *head = list.head;
+      block *tail = head;
+      for (size_t i = 1; i < batch; ++i) {
+        tail = tail->next;
+      }
+      list.head = tail->next;
+      list.count -= batch;
+      tail->next = nullptr;
+      std::unique_lock<std::mutex> lock(mutex);
+      if (batches[index].size() >= max_batches) {
+        lock.unlock();
+        free_chain(head);
+        return;
+      }
+      batches[index].push_back(head);
+    }
+
+    // Refills an empty `list` with one batch, false if there is none.
+    bool take(size_t index, free_list &list) {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (batches[index].empty()) {
+        return false;
+      }
+      list.head = batches[index].back();
+      list.count = batch;
+      batches[index].pop_back();
+      return true;
+    }
+
+   private:
+    std::mutex mutex;
+    std::vector<block *> batches[classes];
+  };
+
+  static size_t size_class(size_t size) { return size == 0 ? 0 : (size - 1) / granule; }
+
+  static free_list *lists() {
+    static thread_local free_list cached[classes];
+    return cached;
+  }
+};
+
+/**
+ * @brief A std::allocator replacement on top of block_cache, for the shared
+ * state of a std::promise.
+ */
+template <typename T>
+struct cached_allocator {
+  using value_type = T;
+
+  cached_allocator() = default;
+  template <typename U>
+  cached_allocator(const cached_allocator<U> &) {}
+
+  T *allocate(size_t n) { return static_cast<T *>(block_cache::allocate(n * sizeof(T))); }
+  void deallocate(T *p, size_t n) { block_cache::deallocate(p, n * sizeof(T)); }
+
+  template <typename U>
+  bool operator==(const cached_allocator<U> &) const {
+    return true;
+  }
+  template <typename U>
+  bool operator!=(const cached_allocator<U> &) const {
+    return false;
+  }
+};
+
+//                                    End class block_cache //
+// =============================================================================================
+// //
+
+// =============================================================================================
+// //
+//                                   Begin class unique_function //
+
+/**
+ * @brief A move-only void() callable, the task type of thread_pool.
+ * @details Unlike std::function it takes move-only callables (a std::promise,
+ * a std::unique_ptr) and keeps callables of up to 48 bytes inline, which
+ * covers a lambda capturing a few pointers or a promise and a pointer. Bigger
+ * ones live in a block_cache block. The whole object is one 64 byte line.
+ */
+class unique_function {
+ public:
+  unique_function() = default;
+
+  template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, unique_function>>>
+  unique_function(F &&f) {
+    using T = std::decay_t<F>;
+    if constexpr (fits_inline<T>()) {
+      new (storage) T(std::forward<F>(f));
+      table = &inline_model<T>::table;
+    } else {
+      void *p = block_cache::allocate(sizeof(T));
+      try {
+        *reinterpret_cast<T **>(storage) = new (p) T(std::forward<F>(f));
+      } catch (...) {
+        block_cache::deallocate(p, sizeof(T));
+        throw;
+      }
+      table = &boxed_model<T>::table;
+    }
+  }
+
+  unique_function(unique_function &&other) noexcept { take(other); }
+
+  unique_function &operator=(unique_function &&other) noexcept {
+    if (this != &other) {
+      reset();
+      take(other);
+    }
+    return *this;
+  }
+
+  unique_function(const unique_function &) = delete;
+  unique_function &operator=(const unique_function &) = delete;
+
+  ~unique_function() { reset(); }
+
+  void operator()() { table->invoke(storage); }
+
+  explicit operator bool() const { return table != nullptr; }
+
+ private:
+  static constexpr size_t inline_size = 48;
+
+  struct operations {
+    void (*invoke)(void *storage);
+    void (*move)(void *from, void *to);  // leaves `from` destroyed
+    void (*destroy)(void *storage);
+  };
+
+  template <typename T>
+  static constexpr bool fits_inline() {
+    return sizeof(T) <= inline_size && alignof(T) <= alignof(std::max_align_t) &&
+           std::is_nothrow_move_constructible_v<T>;
+  }
+
+  template <typename T>
+  struct inline_model {
+    static void invoke(void *storage) { (*static_cast<T *>(storage))(); }
+    static void move(void *from, void *to) {
+      new (to) T(std::move(*static_cast<T *>(from)));
+      static_cast<T *>(from)->~T();
+    }
+    static void destroy(void *storage) { static_cast<T *>(storage)->~T(); }
+    static constexpr operations table{invoke, move, destroy};
+  };
+
+  template <typename T>
+  struct boxed_model {
+    static T *&get(void *storage) { return *static_cast<T **>(storage); }
+    static void invoke(void *storage) { (*get(storage))(); }
+    static void move(void *from, void *to) { *static_cast<T **>(to) = get(from); }
+    static void destroy(void *storage) {
+      T *t = get(storage);
+      t->~T();
+      block_cache::deallocate(t, sizeof(T));
+    }
+    static constexpr operations table{invoke, move, destroy};
+  };
+
+  void take(unique_function &other) {
+    if (other.table != nullptr) {
+      other.table->move(other.storage, storage);
+      table = other.table;
+      other.table = nullptr;
+    }
+  }
+
+  void reset() {
+    if (table != nullptr) {
+      table->destroy(storage);
+      table = nullptr;
+    }
+  }
+
+  alignas(std::max_align_t) unsigned char storage[inline_size];
+  const operations *table = nullptr;
+};
+
+//                                    End class unique_function //
+// =============================================================================================
+// //
+
+// =============================================================================================
+// //
+//                                   Begin class task_deque //
+
+/**
+ * @brief Chase-Lev work-stealing deque of pointers (Chase & Lev, SPAA 2005,
+ * with the C11 orderings of Lê et al., PPoPP 2013).
+ * @details Only the owner thread calls push() and pop(), at the bottom; any
+ * thread may steal() from the top. The deque does not own the items. A full
+ * ring is replaced by one twice its size; the old rings are kept until the
+ * deque is destroyed, since a thief may still be reading from one.
+ *
+ * @tparam T The type pointed to.
+ */
+template <typename T>
+class task_deque {
+  typedef std::int_fast64_t i64;
+
+ public:
+  explicit task_deque(i64 capacity = 64) {
+    rings.emplace_back(new ring(capacity));
+    buffer.store(rings.back().get(), std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief Push an item at the bottom. Owner only.
+   */
+  void push(T *item) {
+    i64 b = bottom.load(std::memory_order_relaxed);
+    i64 t = top.load(std::memory_order_acquire);
+    ring *a = buffer.load(std::memory_order_relaxed);
+    if (b - t > a->capacity - 1) {
+      a = grow(a, t, b);
+    }
+    a->put(b, item);
+    bottom.store(b + 1, std::memory_order_release);
+  }
+
+  /**
+   * @brief Pop the item pushed last. Owner only.
+   *
+   * @return The item, or nullptr if the deque is empty.
+   */
+  T *pop() {
+    i64 b = bottom.load(std::memory_order_relaxed) - 1;
+    ring *a = buffer.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    i64 t = top.load(std::memory_order_relaxed);
+    if (t > b) {
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    T *item = a->get(b);
+    if (t == b) {
+      // The last item, a thief may be taking it too.
+      if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+        item = nullptr;
+      }
+      bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return item;
+  }
+
+  /**
+   * @brief Take the oldest item. Any thread.
+   *
+   * @return The item, or nullptr if the deque is empty or another thread won
+   * the race for it.
+   */
+  T *steal() {
+    i64 t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    i64 b = bottom.load(std::memory_order_acquire);
+    if (t >= b) {
+      return nullptr;
+    }
+    ring *a = buffer.load(std::memory_order_acquire);
+    T *item = a->get(t);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+      return nullptr;
+    }
+    return item;
+  }
+
+  bool empty() const { return bottom.load() <= top.load(); }
+
+ private:
+  struct ring {
+    explicit ring(i64 _capacity) : capacity(_capacity), slots(new std::atomic<T *>[_capacity]) {}
+    T *get(i64 i) const { return slots[i & (capacity - 1)].load(std::memory_order_relaxed); }
+    void put(i64 i, T *item) { slots[i & (capacity - 1)].store(item, std::memory_order_relaxed); }
+    const i64 capacity;  // a power of two
+    std::unique_ptr<std::atomic<T *>[]> slots;
+  };
+
+  ring *grow(ring *a, i64 t, i64 b) {
+    ring *bigger = new ring(2 * a->capacity);
+    for (i64 i = t; i < b; ++i) {
+      bigger->put(i, a->get(i));
+    }
+    rings.emplace_back(bigger);
+    buffer.store(bigger, std::memory_order_release);
+    return bigger;
+  }
+
+  std::atomic<i64> top{0};     // next item to steal
+  std::atomic<i64> bottom{0};  // next free slot
+  std::atomic<ring *> buffer;
+  std::vector<std::unique_ptr<ring>> rings;  // every ring used so far, touched by the owner only
+};
+
+//                                    End class task_deque //
+// =============================================================================================
+// //
+
+// =============================================================================================
+// //
+//                                   Begin class task_ring //
+
+/**
+ * @brief Bounded lock-free multi-producer multi-consumer queue
+ * (Vyukov's bounded MPMC queue).
+ * @details Every cell carries a sequence number telling whether it is free for
+ * the producer at that position or full for the consumer at that position, so
+ * push() and pop() cost one CAS on the shared position plus one release store.
+ * Items are moved into and out of the cells, nothing is allocated after
+ * construction.
+ *
+ * @tparam T The type of the items, default constructible and movable.
+ */
+template <typename T>
+class task_ring {
+ public:
+  /**
+   * @param capacity Rounded up to a power of two.
+   */
+  explicit task_ring(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+      size *= 2;
+    }
+    mask = size - 1;
+    cells.reset(new cell[size]);
+    for (size_t i = 0; i < size; ++i) {
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  /**
+   * @return False if the queue is full, `item` is left alone then.
+   */
+  bool push(T &&item) {
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    cell *c;
+    while (true) {
+      c = &cells[pos & mask];
+      size_t sequence = c->sequence.load(std::memory_order_acquire);
+      std::intptr_t dif = std::intptr_t(sequence) - std::intptr_t(pos);
+      if (dif == 0) {
+        if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (dif < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    c->item = std::move(item);
+    c->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief Move the oldest item into `item`.
+   *
+   * @return False if the queue is empty.
+   */
+  bool pop(T &item) {
+    size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+    cell *c;
+    while (true) {
+      c = &cells[pos & mask];
+      size_t sequence = c->sequence.load(std::memory_order_acquire);
+      std::intptr_t dif = std::intptr_t(sequence) - std::intptr_t(pos + 1);
+      if (dif == 0) {
+        if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (dif < 0) {
+        return false;
+      } else {
+        pos = dequeue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    item = std::move(c->item);
+    c->sequence.store(pos + mask + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief True once every claimed cell was taken. An item whose push is under
+   * way already counts.
+   */
+  bool empty() const { return enqueue_pos.load() == dequeue_pos.load(); }
+
+ private:
+  struct cell {
+    std::atomic<size_t> sequence;
+    T item;
+  };
+
+  std::unique_ptr<cell[]> cells;
+  size_t mask;
+  alignas(64) std::atomic<size_t> enqueue_pos{0};
+  alignas(64) std::atomic<size_t> dequeue_pos{0};
+};
+
+//                                    End class task_ring //
+// =============================================================================================
+// //
+
+// =============================================================================================
+// //
+//                                   Begin class event_count //
+
+/**
+ * @brief Sleep while `*word` holds `expected`, or until woken.
+ */
+inline void futex_wait(std::atomic<std::uint32_t> *word, std::uint32_t expected) {
+  static_assert(sizeof(std::atomic<std::uint32_t>) == sizeof(std::uint32_t), "futex needs a plain 32 bit word");
+  syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(word), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
+
+/**
+ * @brief Wake up to `count` threads sleeping on `word`.
+ */
+inline void futex_wake(std::atomic<std::uint32_t> *word, int count) {
+  syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(word), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+}
+
+/**
+ * @brief Lets a thread sleep until a condition it polls lock-free may have
+ * changed, on a Linux futex.
+ * @details A waiter calls prepare_wait(), checks its condition once more and
+ * then either cancel_wait() or wait(). A notifier makes the condition true and
+ * then calls notify(), which is one fence and one load while nobody sleeps.
+ * The waiter counts itself in before its last check and the notifier reads
+ * that count after publishing, so one of them always sees the other; the
+ * epoch the waiter read makes a notify that lands before the futex call
+ * return at once.
+ */
+class event_count {
+ public:
+  std::uint32_t prepare_wait() {
+    waiters.fetch_add(1);
+    return epoch.load();
+  }
+
+  void cancel_wait() { waiters.fetch_sub(1, std::memory_order_relaxed); }
+
+  void wait(std::uint32_t key) {
+    while (epoch.load(std::memory_order_acquire) == key) {
+      futex_wait(&epoch, key);
+    }
+    waiters.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  void notify_one() { notify(1); }
+  void notify_all() { notify(INT_MAX); }
+
+  /**
+   * @brief Wake up to `count` waiters.
+   */
+  void notify(int count) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters.load(std::memory_order_relaxed) == 0) {
+      return;
+    }
+    epoch.fetch_add(1, std::memory_order_release);
+    futex_wake(&epoch, count);
+  }
+
+ private:
+  alignas(64) std::atomic<std::uint32_t> epoch{0};
+  std::atomic<std::uint32_t> waiters{0};
+};
+
+//                                    End class event_count //
+// =============================================================================================
+// //
+
+// =============================================================================================
+// //
+//                                   Begin class task_latch //
+
+/**
+ * @brief Counts the tasks of one batch (see thread_pool::push_batch) so the
+ * caller waits for exactly those, not for everything in the pool.
+ * @details Unlike std::latch the count may be raised again, by add() or by
+ * push_batch, and the latch reused once it reached zero. The count and a
+ * waiting flag share the futex word: the task that brings the count to zero
+ * touches nothing but that word and wakes the waiters only if there are any,
+ * so a waiter may destroy the latch as soon as wait() returns.
+ */
+class task_latch {
+ public:
+  /**
+   * @brief Expect `n` more count_down() calls.
+   */
+  void add(std::uint32_t n) { count.fetch_add(n, std::memory_order_relaxed); }
+
+  void count_down() {
+    if (count.fetch_sub(1, std::memory_order_acq_rel) == (waiting | 1)) {
+      futex_wake(&count, INT_MAX);
+    }
+  }
+
+  bool done() const { return (count.load(std::memory_order_acquire) & ~waiting) == 0; }
+
+  /**
+   * @brief Block until the count is zero.
+   */
+  void wait() {
+    std::uint32_t c = count.load(std::memory_order_acquire);
+    while ((c & ~waiting) != 0) {
+      if ((c & waiting) == 0 &&
+          !count.compare_exchange_weak(c, c | waiting, std::memory_order_acq_rel, std::memory_order_acquire)) {
+        continue;
+      }
+      futex_wait(&count, c | waiting);
+      c = count.load(std::memory_order_acquire);
+    }
+    // Quiet again, the next count_down to zero need not call into the kernel.
+    c = waiting;
+    count.compare_exchange_strong(c, 0, std::memory_order_relaxed);
+  }
+
+ private:
+  static constexpr std::uint32_t waiting = 1u << 31;
+  std::atomic<std::uint32_t> count{0};
+};
+
+//                                    End class task_latch //
+// =============================================================================================
+// //
+
 /**
  * @brief
  * 线程池结构：1.每一个线程对应一个队列，对每一个队列只有两个线程操作：主线程（唯一）推任务给队列，任务线程弹出任务执行；
@@ -53,13 +674,42 @@
  *
  * 在没有任务执行时：while loop 模式会占用一定的cpu资源，sleep间隔为100ms时20%，1000ms时3%左右。
  * 改用cv 模式，无任务执行时，cpu占用基本为0。此时相对于单线程耗时的一个瓶颈是push_task的锁等待。
+ *
+ * 4. work_stealing 模式：静态分配时一个慢任务（如 100MB 的 stream）会让它那个队列积压，其它线程却空闲。
+ * 此模式下每个线程另有一个 Chase-Lev deque（task_deque），放它自己执行的任务里推入的任务；空闲线程先从别的线程的
+ * deque 顶部偷，再从别的线程的队列取。不带下标的 push_task 轮流分给各个队列，由偷取来平衡。
+ *
+ * 5. 去掉队列锁：每个线程的队列换成有界无锁 MPMC 环（task_ring），push_task 只要几次原子操作；线程只在
+ * 队列为空时才睡在 futex 上（event_count），没人睡时 push_task 不做任何系统调用。
+ * 环满时：池内线程推入的任务直接在当前线程执行，池外线程让出 CPU 重试（推到别的线程的环上，work_stealing 时）。
+ *
+ * 6. 任务类型换成只能移动的 unique_function（48 字节内联存储），直接移进环里；返回 future 的 push_task 用
+ * block_cache 分配 promise 的共享状态。常见任务推入时不再有堆分配。
+ *
+ * 7. 原来每个任务结束都要锁 wait_mutex 并 notify 主线程。现在 tasks_total 降到 0 时才唤醒 wait_for_tasks，
+ * 且只在有人等时才进内核。push_batch 一次推入一批任务（tasks_total 和分配下标各一次原子操作，一次唤醒），
+ * 配合 task_latch 只等自己那一批。
+ *
+ * 8. task_group：每组自己的计数，可以取消（没开始的任务跳过），可以用 then() 接续另一组，组内任务可以继续往组里加任务。
+ * 这样一轮不必等全局的 wait_for_tasks，只等它自己依赖的任务。
  */
 
+class task_group;
+
 class thread_pool {
   typedef std::uint_fast32_t ui32;
   typedef std::uint_fast64_t ui64;
 
  public:
+  /**
+   * @brief How tasks are spread over the threads.
+   * - pinned: a thread runs only the tasks pushed to its own queue.
+   * - work_stealing: a thread that runs out of tasks takes them from the others.
+   */
+  enum class schedule { pinned, work_stealing };
+
+  friend class task_group;
+
   // ============================
   // Constructors and destructors
   // ============================
@@ -71,9 +721,11 @@ class thread_pool {
    * total number of hardware threads available, as reported by the
    * implementation. With a hyperthreaded CPU, this will be twice the number of
    * CPU cores. If the argument is zero, the default value will be used instead.
+   * @param _mode How tasks are spread over the threads.
    */
-  explicit thread_pool(const ui32 &_thread_count = std::thread::hardware_concurrency())
-      : thread_count(_thread_count), threads(new std::thread[_thread_count]) {
+  explicit thread_pool(const ui32 &_thread_count = std::thread::hardware_concurrency(),
+                       schedule _mode = schedule::pinned)
+      : thread_count(_thread_count), mode(_mode), threads(new std::thread[_thread_count]) {
     create_threads();
   }
 
@@ -85,9 +737,9 @@ class thread_pool {
   ~thread_pool() {
     wait_for_tasks();
     running = false;
+    idle.notify_all();
     for (ui32 index = 0; index < thread_count; ++index) {
-      auto condition = worker_conditions[index].get();
-      condition->notify_one();
+      workers[index]->parking.notify_all();
     }
     destroy_threads();
   }
@@ -102,43 +754,51 @@ class thread_pool {
    *
    * @tparam F The type of the function.
    * @param task The function to push.
+   * @param i The thread whose queue the task goes to, -1: any. Called from a
+   * task in work_stealing mode, -1 keeps the task on the calling thread's deque.
    */
   template <typename F>
-  void push_task(const F &task, int i = 0) {
+  void push_task(const F &task, int i = -1) {
     tasks_total++;
-
-    {
-      std::unique_lock<std::mutex> lock(*worker_mutexs[i].get());
-      tasks[i].push(std::function<void()>(task));
-      worker_conditions[i].get()->notify_one();
-    }
+    enqueue(unique_function(task), i);
   }
   /**
    * @brief Push a function with return value into the task
    * queue.
+   * @details The promise's shared state comes from block_cache, the promise
+   * itself travels inside the task.
    *
    * @tparam F The type of the function.
    * @param task The function to push.
-   * @param i The thread use for task;
+   * @param i The thread use for task, -1: any.
    */
   template <class F>
-  auto push_task(F &&f, int i = 0) -> std::future<typename std::invoke_result<F>::type> {
+  auto push_task(F &&f, int i = -1) -> std::future<typename std::invoke_result<F>::type> {
     using return_type = typename std::invoke_result<F>::type;
-    auto task = std::make_shared<std::packaged_task<return_type()>>(f);
-    std::future<return_type> res = task->get_future();
+    std::promise<return_type> promise(std::allocator_arg, cached_allocator<return_type>());
+    std::future<return_type> res = promise.get_future();
     tasks_total++;
-    {
-      std::unique_lock<std::mutex> lock(*worker_mutexs[i].get());
-      tasks[i].push([task]() { (*task)(); });
-      worker_conditions[i].get()->notify_one();
-    }
+    enqueue(
+        [promise = std::move(promise), f = std::forward<F>(f)]() mutable {
+          try {
+            if constexpr (std::is_void_v<return_type>) {
+              f();
+              promise.set_value();
+            } else {
+              promise.set_value(f());
+            }
+          } catch (...) {
+            promise.set_exception(std::current_exception());
+          }
+        },
+        i);
     return res;
   }
   /**
    * @brief Push a function with arguments, but no return value, into the task
    * queue.
    * @details The function is wrapped inside a lambda in order to hide the
-   * arguments, as the tasks in the queue must be of type std::function<void()>,
+   * arguments, as the tasks in the queue must be of type unique_function,
    * so they cannot have any arguments or return value. If no arguments are
    * provided, the other overload will be used, in order to avoid the (slight)
    * overhead of using a lambda.
@@ -153,6 +813,40 @@ class thread_pool {
     push_task([task, args...] { task(args...); });
   }
 
+  /**
+   * @brief Push a batch of functions with no arguments or return value. The
+   * batch is spread over the threads' queues and the threads are woken once
+   * for all of it.
+   *
+   * @tparam It A forward iterator over callables, copied into the tasks (moved
+   * with a std::move_iterator).
+   * @param first The first function to push.
+   * @param last One past the last function to push.
+   * @param done If given, counted down once per finished task of the batch.
+   */
+  template <typename It>
+  void push_batch(It first, It last, task_latch *done = nullptr) {
+    if (done == nullptr) {
+      push_wrapped(first, last, [](auto &&task) { return std::forward<decltype(task)>(task); });
+      return;
+    }
+    done->add(ui32(std::distance(first, last)));
+    push_wrapped(first, last, [done](auto &&task) {
+      return [done, task = std::forward<decltype(task)>(task)]() mutable {
+        task();
+        done->count_down();
+      };
+    });
+  }
+
+  /**
+   * @brief push_batch over a whole range, such as a std::vector of lambdas.
+   */
+  template <typename R>
+  void push_batch(R &&tasks, task_latch *done = nullptr) {
+    push_batch(std::begin(tasks), std::end(tasks), done);
+  }
+
   /**
    * @brief Wait for tasks to be completed. Normally, this function waits for
    * all tasks, both those that are currently running in the threads and those
@@ -163,12 +857,13 @@ class thread_pool {
    * future.
    */
   void wait_for_tasks() {
-    while (true) {
-      std::unique_lock<std::mutex> lock(wait_mutex);
-      wait_condition.wait(lock, [this] { return !this->running || tasks_total == 0; });
+    while (tasks_total != 0) {
+      std::uint32_t key = all_done.prepare_wait();
       if (tasks_total == 0) {
+        all_done.cancel_wait();
         break;
       }
+      all_done.wait(key);
     }
   }
   /**
@@ -179,6 +874,25 @@ class thread_pool {
   ui32 get_thread_count() const { return thread_count; }
 
  private:
+  /**
+   * @brief The number of tasks one thread's queue holds.
+   */
+  static constexpr size_t queue_capacity = 1024;
+
+  /**
+   * @brief How often an idle thread looks for tasks again before it sleeps.
+   */
+  static constexpr ui32 spin_rounds = 64;
+
+  /**
+   * @brief The queues of one thread.
+   */
+  struct worker_slot {
+    task_ring<unique_function> tasks{queue_capacity};  // pushed from outside the pool, or pinned
+    task_deque<unique_function> local;                 // work_stealing: pushed by this thread's own tasks, boxed
+    event_count parking;                                     // pinned: 主线程notify 任务线程
+  };
+
   // ========================
   // Private member functions
   // ========================
@@ -187,12 +901,11 @@ class thread_pool {
    * @brief Create the threads in the pool and assign a worker to each thread.
    */
   void create_threads() {
-    tasks.resize(thread_count);
-    worker_conditions.resize(thread_count);
-    worker_mutexs.resize(thread_count);
+    workers.resize(thread_count);
+    for (ui32 i = 0; i < thread_count; ++i) {
+      workers[i] = std::make_unique<worker_slot>();
+    }
     for (ui32 i = 0; i < thread_count; ++i) {
-      worker_conditions[i] = std::make_unique<std::condition_variable>();
-      worker_mutexs[i] = std::make_unique<std::mutex>();
       threads[i] = std::thread(&thread_pool::worker, this, i);
     }
   }
@@ -206,30 +919,200 @@ class thread_pool {
     }
   }
 
+  /**
+   * @brief Queue a task counted in tasks_total on thread i, -1: any.
+   */
+  void enqueue(unique_function &&task, int i) {
+    if (i < 0 && mode == schedule::work_stealing && current_pool == this) {
+      // Pushed by one of our tasks: the owner end of that thread's deque.
+      workers[current_worker]->local.push(box(std::move(task)));
+      idle.notify_one();
+      return;
+    }
+    ui32 index = i < 0 ? ui32(next_worker++ % thread_count) : ui32(i) % thread_count;
+    if (push_to(index, std::move(task))) {
+      wake(index, 1);
+    }
+  }
+
+  /**
+   * @brief Push one task, -1 style: the caller's deque or the next queue.
+   */
+  void push(unique_function &&task) {
+    tasks_total++;
+    enqueue(std::move(task), -1);
+  }
+
+  /**
+   * @brief The body of push_batch: pushes wrap(*it) for every it in the
+   * range.
+   */
+  template <typename It, typename W>
+  void push_wrapped(It first, It last, W &&wrap) {
+    ui32 n = ui32(std::distance(first, last));
+    if (n == 0) {
+      return;
+    }
+    tasks_total += n;
+    ui64 start = next_worker.fetch_add(n);
+    for (ui32 k = 0; first != last; ++first, ++k) {
+      push_to(ui32((start + k) % thread_count), wrap(*first));
+    }
+    wake(ui32(start % thread_count), n);
+  }
+
+  /**
+   * @brief Put a task counted in tasks_total on the queue of thread index.
+   * Wakes nobody while there is room; a full queue wakes its thread first,
+   * since the tasks of a batch are only announced once all are queued.
+   *
+   * @return False if it was run right here instead.
+   */
+  bool push_to(ui32 index, unique_function &&task) {
+    while (!workers[index]->tasks.push(std::move(task))) {
+      if (current_pool == this) {
+        // Waiting would deadlock if the full queue is our own, run it here.
+        run(task);
+        return false;
+      }
+      wake(index, thread_count);
+      if (mode == schedule::work_stealing) {
+        index = ui32(next_worker++ % thread_count);
+      }
+      std::this_thread::yield();
+    }
+    return true;
+  }
+
+  /**
+   * @brief Wake the threads for `n` tasks pushed to the queues from `index` on.
+   */
+  void wake(ui32 index, ui32 n) {
+    if (mode == schedule::work_stealing) {
+      idle.notify(int(std::min(n, thread_count)));
+      return;
+    }
+    for (ui32 k = 0; k < std::min(n, thread_count); ++k) {
+      workers[(index + k) % thread_count]->parking.notify_one();
+    }
+  }
+
+  /**
+   * @brief Take the next task for thread id: its own deque, its own queue,
+   * then in work_stealing mode the other threads' deques and queues.
+   *
+   * @return False if there was none.
+   */
+  bool next_task(ui32 id, unique_function &task) {
+    worker_slot &slot = *workers[id];
+    if (unbox(slot.local.pop(), task) || slot.tasks.pop(task)) {
+      return true;
+    }
+    if (mode != schedule::work_stealing) {
+      return false;
+    }
+    for (ui32 k = 1; k < thread_count; ++k) {
+      worker_slot &victim = *workers[(id + k) % thread_count];
+      if (unbox(victim.local.steal(), task) || victim.tasks.pop(task)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * @brief A task moved into a block_cache block, for the deques, which hold
+   * pointers.
+   */
+  static unique_function *box(unique_function &&task) {
+    return new (block_cache::allocate(sizeof(unique_function))) unique_function(std::move(task));
+  }
+
+  /**
+   * @brief Move a boxed task into `task` and free its box.
+   */
+  static bool unbox(unique_function *boxed, unique_function &task) {
+    if (boxed == nullptr) {
+      return false;
+    }
+    task = std::move(*boxed);
+    boxed->~unique_function();
+    block_cache::deallocate(boxed, sizeof(unique_function));
+    return true;
+  }
+
+  /**
+   * @brief Whether next_task(id) may find something.
+   */
+  bool has_tasks(ui32 id) const {
+    if (mode != schedule::work_stealing) {
+      return !workers[id]->local.empty() || !workers[id]->tasks.empty();
+    }
+    for (ui32 k = 0; k < thread_count; ++k) {
+      if (!workers[k]->local.empty() || !workers[k]->tasks.empty()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * @brief Run a task counted in tasks_total.
+   */
+  void run(unique_function &task) {
+    task();         // this should be in parallel
+    task = unique_function();  // captures go now, not with the next task
+    if (tasks_total.fetch_sub(1) == 1) {
+      all_done.notify_all();
+    }
+  }
+
+  /**
+   * @brief On one of the pool's threads, run one queued task if there is one.
+   */
+  bool run_one() {
+    unique_function task;
+    if (!next_task(current_worker, task)) {
+      return false;
+    }
+    run(task);
+    return true;
+  }
+
   /**
    * @brief A worker function to be assigned to each thread in the pool.
    * Continuously pops tasks out of the queue and executes them, as long as the
    * atomic variable running is set to true.
    */
-  void worker(int thread_id) {
-    while (running) {
-      std::function<void()> task;
-      {
-        std::unique_lock<std::mutex> lock(*worker_mutexs[thread_id].get());
-        auto condition = worker_conditions[thread_id].get();
-        condition->wait(lock, [this, thread_id] { return !this->running || !this->tasks[thread_id].empty(); });
-        if (!running && this->tasks[thread_id].empty()) {
-          return;
-        }
-        task = std::move(tasks[thread_id].front());
-        this->tasks[thread_id].pop();
+  void worker(ui32 thread_id) {
+    current_pool = this;
+    current_worker = thread_id;
+    event_count &parking = mode == schedule::work_stealing ? idle : workers[thread_id]->parking;
+    ui32 idle_rounds = 0;
+    unique_function task;
+    while (true) {
+      if (next_task(thread_id, task)) {
+        run(task);
+        idle_rounds = 0;
+        continue;
       }
-      task();         // this shouled be in parallel
-      tasks_total--;  // atomic
-      {
-        std::unique_lock<std::mutex> lock(wait_mutex);
-        wait_condition.notify_one();
+      // Tiny tasks come faster than a futex round trip, look again a few
+      // times before sleeping.
+      if (idle_rounds++ < spin_rounds) {
+        std::this_thread::yield();
+        continue;
       }
+      idle_rounds = 0;
+      std::uint32_t key = parking.prepare_wait();
+      if (has_tasks(thread_id)) {
+        parking.cancel_wait();
+        continue;
+      }
+      if (!running) {
+        parking.cancel_wait();
+        return;
+      }
+      parking.wait(key);
     }
   }
 
@@ -238,13 +1121,10 @@ class thread_pool {
   // ============
 
   /**
-   * @brief worker_mutexs and worker_conditions protect one queue read and write from same time;
-   *
+   * @brief The queues of every thread.
    */
-  std::vector<std::unique_ptr<std::condition_variable>> worker_conditions;  // 主线程notify 任务线程
-  std::vector<std::unique_ptr<std::mutex>> worker_mutexs;
-  std::condition_variable wait_condition;  // 任务线程notify 主线程
-  std::mutex wait_mutex;
+  std::vector<std::unique_ptr<worker_slot>> workers;
+  event_count all_done;  // 任务线程notify 主线程, when tasks_total drops to zero
   /**
    * @brief An atomic variable indicating to the workers to keep running. When
    * set to false, the workers permanently stop working.
@@ -252,14 +1132,14 @@ class thread_pool {
   std::atomic<bool> running = true;
 
   /**
-   * @brief A queue of tasks to be executed by the threads.
+   * @brief The number of threads in the pool.
    */
-  std::vector<std::queue<std::function<void()>>> tasks;
+  ui32 thread_count;
 
   /**
-   * @brief The number of threads in the pool.
+   * @brief How tasks are spread over the threads.
    */
-  ui32 thread_count;
+  const schedule mode;
 
   /**
    * @brief A smart pointer to manage the memory allocated for the threads.
@@ -271,12 +1151,180 @@ class thread_pool {
    * tasks - either still in the queue, or running in a thread.
    */
   std::atomic<ui32> tasks_total{0};
+
+  /**
+   * @brief work_stealing: where idle threads sleep, any of them may take a new task.
+   */
+  event_count idle;
+
+  /**
+   * @brief The queue the next push_task without a thread goes to.
+   */
+  std::atomic<ui64> next_worker{0};
+
+  /**
+   * @brief The pool and thread the calling thread works for, if any.
+   */
+  static inline thread_local thread_pool *current_pool = nullptr;
+  static inline thread_local ui32 current_worker = 0;
 };
 
 //                                     End class thread_pool //
 // =============================================================================================
 // //
 
+// =============================================================================================
+// //
+//                                   Begin class task_group //
+
+/**
+ * @brief Tasks on a thread_pool that are waited for, cancelled and followed
+ * up together, independently of everything else in the pool.
+ * @details A task of the group may add more tasks to it, the group is done
+ * once all of them are. then() queues a task on another group for when this
+ * one is done, so a chain of groups runs without anyone waiting in between.
+ * cancel() skips the tasks that have not started yet and the continuations;
+ * running tasks may poll is_cancelled(). The destructor waits, a group must
+ * outlive the continuations other groups have for it.
+ */
+class task_group {
+  typedef std::uint32_t ui32;
+
+ public:
+  explicit task_group(thread_pool &_pool) : pool(_pool) {}
+
+  task_group(const task_group &) = delete;
+  task_group &operator=(const task_group &) = delete;
+
+  ~task_group() { wait(); }
+
+  /**
+   * @brief Push a function with no arguments or return value as a task of
+   * this group.
+   */
+  template <typename F>
+  void run(F &&f) {
+    started(1);
+    pool.push(wrap(std::forward<F>(f)));
+  }
+
+  /**
+   * @brief Push a range of functions as tasks of this group, with
+   * thread_pool::push_batch.
+   */
+  template <typename It>
+  void run_batch(It first, It last) {
+    started(ui32(std::distance(first, last)));
+    pool.push_wrapped(first, last, [this](auto &&f) { return wrap(std::forward<decltype(f)>(f)); });
+  }
+
+  template <typename R>
+  void run_batch(R &&tasks) {
+    run_batch(std::begin(tasks), std::end(tasks));
+  }
+
+  /**
+   * @brief Run `f` as a task of `next` once this group is done (at once if it
+   * is done already). `next` counts it from now on, so waiting on `next`
+   * waits for this group too. Skipped if this group or `next` was cancelled.
+   */
+  template <typename F>
+  void then(task_group &next, F &&f) {
+    next.started(1);
+    unique_function continuation(std::forward<F>(f));
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (active.load(std::memory_order_acquire) != 0) {
+        continuations.emplace_back(&next, std::move(continuation));
+        return;
+      }
+    }
+    next.continue_with(std::move(continuation), is_cancelled());
+  }
+
+  /**
+   * @brief Skip every task and continuation of this group that has not
+   * started yet. There is no undoing it.
+   */
+  void cancel() { cancelled.store(true, std::memory_order_relaxed); }
+
+  bool is_cancelled() const { return cancelled.load(std::memory_order_relaxed); }
+
+  /**
+   * @brief Block until every task of the group finished or was skipped. On
+   * one of the pool's threads it runs other queued tasks meanwhile, rather
+   * than holding a thread the group may need.
+   */
+  void wait() {
+    if (thread_pool::current_pool != &pool) {
+      done.wait();
+      return;
+    }
+    while (!done.done()) {
+      if (!pool.run_one()) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+ private:
+  void started(ui32 n) {
+    active.fetch_add(n, std::memory_order_relaxed);
+    done.add(n);
+  }
+
+  template <typename F>
+  unique_function wrap(F &&f) {
+    return [this, f = std::forward<F>(f)]() mutable {
+      if (!is_cancelled()) {
+        f();
+      }
+      finished();
+    };
+  }
+
+  /**
+   * @brief Queue a continuation already counted by started().
+   */
+  void continue_with(unique_function &&f, bool skip) {
+    pool.push([this, f = std::move(f), skip]() mutable {
+      if (!skip && !is_cancelled()) {
+        f();
+      }
+      finished();
+    });
+  }
+
+  void finished() {
+    if (active.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      std::vector<std::pair<task_group *, unique_function>> ready;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        // A task may have been added since, then its end fires them.
+        if (active.load(std::memory_order_acquire) == 0) {
+          ready.swap(continuations);
+        }
+      }
+      for (auto &continuation : ready) {
+        continuation.first->continue_with(std::move(continuation.second), is_cancelled());
+      }
+    }
+    // The last use of this group, wait() may return and destroy it.
+    done.count_down();
+  }
+
+  thread_pool &pool;
+  std::atomic<ui32> active{0};  // tasks not finished, decides when continuations fire
+  task_latch done;              // the same count, for wait(), counted down last
+  std::atomic<bool> cancelled{false};
+  std::mutex mutex;  // guards continuations
+  std::vector<std::pair<task_group *, unique_function>> continuations;
+};
+
+//                                    End class task_group //
+// =============================================================================================
+// //
+
 // =============================================================================================
 // //
 //                                   Begin class synced_stream //
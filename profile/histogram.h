@@ -0,0 +1,126 @@
+#pragma once
+/**
+ * @file histogram.h
+ * @brief Log-linear latency histogram shared by the benchmark binaries.
+ * @details Same bucketing idea as HdrHistogram: values below 2^kSubBits are
+ * recorded exactly, every following power of two is split into 2^kSubBits
+ * equal sub-buckets, so the relative error of any reported percentile stays
+ * below 1/2^kSubBits (<0.8%) over the whole uint64 range. Recording is a
+ * couple of shifts and one increment, no allocation. A histogram is not
+ * thread safe: give every worker its own and Merge() them at the end.
+ */
+
+#include <algorithm>  // std::min, std::max
+#include <cstdint>    // std::uint64_t
+#include <iomanip>    // std::setprecision
+#include <limits>     // std::numeric_limits
+#include <ostream>    // std::ostream
+#include <vector>     // std::vector
+
+class histogram {
+  typedef std::uint64_t ui64;
+
+ public:
+  static constexpr int kSubBits = 7;
+  static constexpr ui64 kSubCount = ui64(1) << kSubBits;
+
+  histogram() : counts((64 - kSubBits + 1) * kSubCount, 0) {}
+
+  /**
+   * @brief Record one value (nanoseconds for latencies).
+   */
+  void Record(ui64 value) {
+    counts[Index(value)]++;
+    total++;
+    sum += value;
+    min_value = std::min(min_value, value);
+    max_value = std::max(max_value, value);
+  }
+
+  /**
+   * @brief Add all samples of another histogram into this one.
+   */
+  void Merge(const histogram &other) {
+    for (size_t i = 0; i < counts.size(); ++i) {
+      counts[i] += other.counts[i];
+    }
+    total += other.total;
+    sum += other.sum;
+    min_value = std::min(min_value, other.min_value);
+    max_value = std::max(max_value, other.max_value);
+  }
+
+  void Reset() {
+    std::fill(counts.begin(), counts.end(), 0);
+    total = 0;
+    sum = 0;
+    min_value = std::numeric_limits<ui64>::max();
+    max_value = 0;
+  }
+
+  ui64 Count() const { return total; }
+  ui64 Min() const { return total ? min_value : 0; }
+  ui64 Max() const { return max_value; }
+  double Mean() const { return total ? double(sum) / total : 0; }
+
+  /**
+   * @brief Value at the given percentile (0-100), reported as the midpoint of
+   * the bucket holding it and clamped to the recorded min/max.
+   */
+  ui64 Percentile(double p) const {
+    if (total == 0) {
+      return 0;
+    }
+    ui64 rank = ui64(p / 100.0 * total + 0.5);
+    rank = std::max<ui64>(1, std::min(rank, total));
+    ui64 seen = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+      seen += counts[i];
+      if (seen >= rank) {
+        ui64 lo = LowestEquivalent(i);
+        ui64 mid = lo + (BucketWidth(i) - 1) / 2;
+        return std::max(Min(), std::min(mid, max_value));
+      }
+    }
+    return max_value;
+  }
+
+  /**
+   * @brief Print "count/mean/p50/p90/p99/p999/max" with values divided by
+   * `scale` (1000 turns recorded nanoseconds into microseconds).
+   */
+  void Print(std::ostream &out, double scale = 1000.0, const char *unit = "us") const {
+    out << std::fixed << std::setprecision(1) << "count:" << total << " mean:" << Mean() / scale << unit
+        << " p50:" << Percentile(50) / scale << unit << " p90:" << Percentile(90) / scale << unit
+        << " p99:" << Percentile(99) / scale << unit << " p999:" << Percentile(99.9) / scale << unit
+        << " max:" << Max() / scale << unit;
+  }
+
+ private:
+  static size_t Index(ui64 value) {
+    if (value < kSubCount) {
+      return size_t(value);
+    }
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - kSubBits;
+    return size_t(shift + 1) * kSubCount + size_t((value >> shift) - kSubCount);
+  }
+
+  static ui64 LowestEquivalent(size_t index) {
+    if (index < kSubCount) {
+      return index;
+    }
+    int shift = int(index / kSubCount) - 1;
+    return (kSubCount + index % kSubCount) << shift;
+  }
+
+  static ui64 BucketWidth(size_t index) {
+    return index < kSubCount ? 1 : ui64(1) << (index / kSubCount - 1);
+  }
+
+  std::vector<ui64> counts;
+  ui64 total = 0;
+  ui64 sum = 0;
+  ui64 min_value = std::numeric_limits<ui64>::max();
+  ui64 max_value = 0;
+};
@@ -0,0 +1,32 @@
+#include <iostream>
+#include <limits>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+
+#include "profile/http/httplib.h"
+
+ABSL_FLAG(uint16_t, port, 50051, "Server port for the service");
+
+// HTTP peer for //profile:bench: accepts the request body and answers with the
+// same short reply as the grpc and socket servers.
+int main(int argc, char** argv) {
+    absl::ParseCommandLine(argc, argv);
+    uint16_t port = absl::GetFlag(FLAGS_port);
+
+    httplib::Server server;
+    server.set_tcp_nodelay(true);
+    // httplib closes a keep-alive connection after 5 requests by default, which
+    // would add a reconnect to every 5th call of the benchmark.
+    server.set_keep_alive_max_count(std::numeric_limits<size_t>::max());
+    server.Post("/hello", [](const httplib::Request& req, httplib::Response& res) {
+        res.set_content("Hello from server", "text/plain");
+    });
+
+    std::cout << "Server listening on 0.0.0.0:" << port << std::endl;
+    if (!server.listen("0.0.0.0", port)) {
+        std::cerr << "listen failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -1,30 +1,49 @@
 #include <iostream>
 #include <cstring>
+#include <thread>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 #include "absl/strings/str_format.h"
 
 ABSL_FLAG(uint16_t, port, 50051, "Server port for the service");
+ABSL_FLAG(uint32_t, length, 25000, "request size in bytes, must match the client");
 
-int RunServer(uint16_t port) {
+// One thread per connection: read exactly `length` bytes, then reply once.
+void ServeConnection(int sock, uint32_t length) {
+  std::string buffer(length, 0);
+  const char *hello = "Hello from server";
+  while (true) {
+    size_t received = 0;
+    while (received < length) {
+      ssize_t n = read(sock, &buffer[received], length - received);
+      if (n <= 0) {
+        close(sock);
+        return;
+      }
+      received += n;
+    }
+    send(sock, hello, strlen(hello), 0);
+  }
+}
+
+int RunServer(uint16_t port, uint32_t length) {
   std::cout<<"========== mydebug: start socket server port:"<<port<<std::endl;
   int server_fd, new_socket;
   struct sockaddr_in address;
   int addrlen = sizeof(address);
-  char buffer[102400] = {0};
-  int length=25000;
-  std::string send_data(length, 'a');
-  const char *hello = "Hello from server";
+  int opt = 1;
 
   // 创建 Socket
   if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
       perror("socket failed");
       return 1;
   }
+  setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
   address.sin_family = AF_INET;
   address.sin_addr.s_addr = INADDR_ANY;
@@ -37,30 +56,25 @@ int RunServer(uint16_t port) {
   }
 
   // 监听
-  if (listen(server_fd, 3) < 0) {
+  if (listen(server_fd, 128) < 0) {
       perror("listen failed");
       return 1;
   }
 
-  if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
-      perror("accept failed");
-      return 1;
-  }
-
   while(true){
-  // 从客户端接收消息
-  read(new_socket, buffer, 25000);
-  // std::cout << "Client: " << buffer << std::endl;
-
-  // 发送消息给客户端
-  send(new_socket, hello, strlen(hello), 0);
-  // std::cout << "Hello message sent" << std::endl;
+    if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
+        perror("accept failed");
+        return 1;
+    }
+    // 关闭 Nagle, 否则回复会被延迟 ACK 卡住
+    setsockopt(new_socket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    std::thread(ServeConnection, new_socket, length).detach();
   }
 
   return 0;
 }
 int main(int argc, char** argv) {
   absl::ParseCommandLine(argc, argv);
-  RunServer(absl::GetFlag(FLAGS_port));
+  RunServer(absl::GetFlag(FLAGS_port), absl::GetFlag(FLAGS_length));
   return 0;
 }